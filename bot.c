@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BOT_X86
+#endif
+
+#include "bot.h"
+
+/* The dictionary, packed for filtering: each word padded with zeros to
+ * BOT_ROW bytes and aligned so a row is one AVX2 load, and the set of
+ * letters in each word as a mask with bit i for letter 'a' + i. Words
+ * are grouped by length; those of length n are rows by_length[n] up to
+ * by_length[n + 1], so only words of the right length are filtered.
+ */
+static char *rows = NULL;
+static unsigned int *word_letters = NULL;
+static int num_words = 0;
+static int by_length[MAX_WORD + 1];
+
+/* What a word must look like to still be possible, built once per turn
+ * from the board. A word fits if every byte where known is set equals
+ * the byte in pattern, and every other byte is a letter that has not
+ * been guessed. Positions past the end of the word are known to be '\0',
+ * which also rules out words of a different length.
+ */
+struct board_filter {
+    unsigned char pattern[BOT_ROW] __attribute__((aligned(32)));
+    unsigned char known[BOT_ROW] __attribute__((aligned(32)));
+    unsigned int guessed;
+    // For looking up whether a byte is a guessed letter 16 bytes at a
+    // time: byte b is guessed if lo[b & 15] & hi[b >> 4] is not zero.
+    unsigned char lo[16] __attribute__((aligned(16)));
+    unsigned char hi[16] __attribute__((aligned(16)));
+};
+
+typedef int (*filter_fn)(struct board_filter *f, int *match, int first, int end);
+static filter_fn filter_words = NULL;
+
+
+/* Return the length of the dictionary line in buf if bots can use it,
+ * or -1. init_game could still pick a word we skip here; bots then go by
+ * all the words of its length (see bot_choose_letter).
+ */
+static int usable_word(char *buf) {
+    buf[strcspn(buf, "\r\n")] = '\0';
+    int len = strlen(buf);
+    if (len == 0 || len >= MAX_WORD - 1 || strspn(buf, "abcdefghijklmnopqrstuvwxyz") != len) {
+        return -1;
+    }
+    return len;
+}
+
+/* Read the words of dict into memory. The file is left rewound for
+ * init_game. Returns the number of words, or -1 if memory ran out.
+ */
+int bot_load(struct dictionary *dict) {
+    char buf[MAX_BUF];
+    int next[MAX_WORD];
+    int len;
+    if (rows != NULL) {
+        return num_words;
+    }
+    if (posix_memalign((void **)&rows, BOT_ROW, (size_t)dict->size * BOT_ROW + BOT_ROW) != 0
+        || (word_letters = malloc(sizeof(unsigned int) * (dict->size + 1))) == NULL) {
+        perror("bot_load");
+        free(rows);
+        rows = NULL;
+        return -1;
+    }
+    memset(rows, 0, (size_t)dict->size * BOT_ROW);
+
+    // Count the words of each length, then put each in its group
+    memset(by_length, 0, sizeof(by_length));
+    rewind(dict->fp);
+    while (fgets(buf, MAX_BUF, dict->fp) != NULL) {
+        if ((len = usable_word(buf)) != -1) {
+            by_length[len + 1]++;
+        }
+    }
+    for (len = 1; len <= MAX_WORD; len++) {
+        by_length[len] += by_length[len - 1];
+    }
+    memcpy(next, by_length, sizeof(next));
+
+    rewind(dict->fp);
+    while (fgets(buf, MAX_BUF, dict->fp) != NULL) {
+        unsigned int mask = 0;
+        if ((len = usable_word(buf)) == -1 || next[len] >= dict->size) {
+            continue;
+        }
+        for (int i = 0; i < len; i++) {
+            mask |= 1u << (buf[i] - 'a');
+        }
+        memcpy(rows + next[len] * BOT_ROW, buf, len);
+        word_letters[next[len]++] = mask;
+        num_words++;
+    }
+    rewind(dict->fp);
+    printf("Bots know %d words\n", num_words);
+    return num_words;
+}
+
+static int filter_scalar(struct board_filter *f, int *match, int first, int end) {
+    int found = 0;
+    for (int w = first; w < end; w++) {
+        unsigned char *row = (unsigned char *)rows + w * BOT_ROW;
+        int i;
+        for (i = 0; i < BOT_ROW; i++) {
+            if (f->known[i] ? row[i] != f->pattern[i]
+                : row[i] == '\0' || (f->guessed >> (row[i] - 'a')) & 1) {
+                break;
+            }
+        }
+        if (i == BOT_ROW) {
+            match[found++] = w;
+        }
+    }
+    return found;
+}
+
+#ifdef BOT_X86
+/* Return 0xff in each byte of v that fits the filter. */
+__attribute__((target("ssse3")))
+static __m128i fits_sse(struct board_filter *f, __m128i v, int half) {
+    __m128i pattern = _mm_load_si128((__m128i *)(f->pattern + 16 * half));
+    __m128i known = _mm_load_si128((__m128i *)(f->known + 16 * half));
+    __m128i lo = _mm_load_si128((__m128i *)f->lo);
+    __m128i hi = _mm_load_si128((__m128i *)f->hi);
+    __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i zero = _mm_setzero_si128();
+
+    __m128i guessed = _mm_and_si128(_mm_shuffle_epi8(lo, _mm_and_si128(v, nibble)),
+        _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+    // A byte that is not known must be neither '\0' nor a guessed letter
+    __m128i bad = _mm_or_si128(_mm_cmpeq_epi8(v, zero),
+        _mm_xor_si128(_mm_cmpeq_epi8(guessed, zero), _mm_set1_epi8(-1)));
+    return _mm_or_si128(_mm_and_si128(known, _mm_cmpeq_epi8(v, pattern)),
+        _mm_andnot_si128(known, _mm_xor_si128(bad, _mm_set1_epi8(-1))));
+}
+
+__attribute__((target("ssse3")))
+static int filter_sse(struct board_filter *f, int *match, int first, int end) {
+    int found = 0;
+    for (int w = first; w < end; w++) {
+        __m128i *row = (__m128i *)(rows + w * BOT_ROW);
+        __m128i ok = _mm_and_si128(fits_sse(f, _mm_load_si128(row), 0),
+            fits_sse(f, _mm_load_si128(row + 1), 1));
+        if (_mm_movemask_epi8(ok) == 0xffff) {
+            match[found++] = w;
+        }
+    }
+    return found;
+}
+
+/* The same test as fits_sse, one whole row at a time. _mm256_shuffle_epi8
+ * looks up each 128 bit lane separately, so the tables are repeated in
+ * both lanes.
+ */
+__attribute__((target("avx2")))
+static int filter_avx2(struct board_filter *f, int *match, int first, int end) {
+    __m256i pattern = _mm256_load_si256((__m256i *)f->pattern);
+    __m256i known = _mm256_load_si256((__m256i *)f->known);
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)f->lo));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)f->hi));
+    __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i ones = _mm256_set1_epi8(-1);
+    int found = 0;
+
+    for (int w = first; w < end; w++) {
+        __m256i v = _mm256_load_si256((__m256i *)(rows + w * BOT_ROW));
+        __m256i guessed = _mm256_and_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble)),
+            _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+        __m256i bad = _mm256_or_si256(_mm256_cmpeq_epi8(v, zero),
+            _mm256_xor_si256(_mm256_cmpeq_epi8(guessed, zero), ones));
+        __m256i ok = _mm256_or_si256(_mm256_and_si256(known, _mm256_cmpeq_epi8(v, pattern)),
+            _mm256_andnot_si256(known, _mm256_xor_si256(bad, ones)));
+        if (_mm256_movemask_epi8(ok) == -1) {
+            match[found++] = w;
+        }
+    }
+    return found;
+}
+#endif
+
+/* Use the widest filter this CPU can run. */
+static void pick_filter() {
+    filter_words = filter_scalar;
+#ifdef BOT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        filter_words = filter_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        filter_words = filter_sse;
+    }
+#endif
+}
+
+static void make_filter(struct board_filter *f, struct game_state *game) {
+    int len = strlen(game->guess);
+    memset(f, 0, sizeof(*f));
+    for (int i = 0; i < BOT_ROW; i++) {
+        if (i >= len || game->guess[i] != '-') {
+            f->known[i] = 0xff;
+            f->pattern[i] = i < len ? game->guess[i] : '\0';
+        }
+    }
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        if (game->letters_guessed[i]) {
+            int b = 'a' + i;
+            f->guessed |= 1u << i;
+            f->lo[b & 15] |= 1 << (b >> 4);
+        }
+    }
+    for (int i = 0; i < 8; i++) {
+        f->hi[i] = 1 << i;
+    }
+}
+
+/* Run every filter this CPU can run against the scalar one on the board
+ * of game. Returns the number of words that fit, or -1 if the filters
+ * disagree. Used by bottest.
+ */
+int bot_check_filters(struct game_state *game) {
+    static int *want = NULL, *got = NULL;
+    filter_fn filters[2];
+    int num_filters = 0;
+    struct board_filter f;
+
+    if (want == NULL && ((want = malloc(sizeof(int) * (num_words + 1))) == NULL
+        || (got = malloc(sizeof(int) * (num_words + 1))) == NULL)) {
+        perror("malloc");
+        exit(1);
+    }
+#ifdef BOT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        filters[num_filters++] = filter_sse;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        filters[num_filters++] = filter_avx2;
+    }
+#endif
+    make_filter(&f, game);
+    int len = strlen(game->guess);
+    int found = filter_scalar(&f, want, by_length[len], by_length[len + 1]);
+    for (int i = 0; i < num_filters; i++) {
+        if (filters[i](&f, got, by_length[len], by_length[len + 1]) != found
+            || memcmp(want, got, sizeof(int) * found) != 0) {
+            return -1;
+        }
+    }
+    return found;
+}
+
+/* Count, for every letter not guessed yet, how many words that still fit
+ * the board contain it. Returns the number of words that fit.
+ */
+int bot_candidates(struct game_state *game, int *counts) {
+    static int *match = NULL;
+    struct board_filter f;
+
+    if (filter_words == NULL) {
+        pick_filter();
+    }
+    if (match == NULL && (match = malloc(sizeof(int) * (num_words + 1))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    make_filter(&f, game);
+    int len = strlen(game->guess);
+    int found = filter_words(&f, match, by_length[len], by_length[len + 1]);
+
+    memset(counts, 0, sizeof(int) * NUM_LETTERS);
+    for (int j = 0; j < found; j++) {
+        unsigned int mask = word_letters[match[j]] & ~f.guessed;
+        while (mask) {
+            counts[__builtin_ctz(mask)]++;
+            mask &= mask - 1;
+        }
+    }
+    return found;
+}
+
+/* Pick the letter that says the most about the word: the one whose
+ * answer splits the remaining words most evenly. When every split is
+ * lopsided, as with one word left, take the letter in the most words.
+ */
+char bot_choose_letter(struct game_state *game) {
+    int counts[NUM_LETTERS];
+    int found = bot_candidates(game, counts);
+    int best = -1, best_split = -1;
+
+    if (found == 0) {
+        // The word is not one we know; go by all words of its length
+        struct game_state blank = *game;
+        memset(blank.guess, '-', strlen(game->guess));
+        memset(blank.letters_guessed, 0, sizeof(blank.letters_guessed));
+        found = bot_candidates(&blank, counts);
+    }
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        if (game->letters_guessed[i]) {
+            continue;
+        }
+        int split = counts[i] < found - counts[i] ? counts[i] : found - counts[i];
+        if (best == -1 || split > best_split
+            || (split == best_split && counts[i] > counts[best])) {
+            best = i;
+            best_split = split;
+        }
+    }
+    return best == -1 ? 'a' : 'a' + best;
+}
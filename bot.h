@@ -0,0 +1,20 @@
+#ifndef _BOT_H_
+#define _BOT_H_
+
+#include "gameplay.h"
+
+#define BOT_CMD "/bot"          // Entered on your turn to add a bot to the room
+#define BOT_DELAY_MS 750        // How long a bot takes over its turn
+#define MAX_BOTS 3              // Bots allowed in one room
+#define BOT_ROW 32              // Bytes per word in the packed dictionary
+
+/* Bots are players with no connection. They only play while a person is
+ * connected to the room, and choose letters from the words in the
+ * dictionary that still fit the board.
+ */
+int bot_load(struct dictionary *dict);
+char bot_choose_letter(struct game_state *game);
+int bot_candidates(struct game_state *game, int *counts);
+int bot_check_filters(struct game_state *game);
+
+#endif
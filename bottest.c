@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bot.h"
+
+/* bottest: check that the bots' word filters agree ("make check").
+ *
+ * A dictionary of random words is made up, and for many random boards
+ * every filter this CPU can run must find the same words as the scalar
+ * one. Words use few letters, so boards have many words that fit.
+ */
+
+#define TEST_WORDS 5000
+#define TEST_BOARDS 3000
+
+static char words[TEST_WORDS][MAX_WORD];
+
+static void random_word(char *word) {
+    int len = 1 + random() % (MAX_WORD - 3);
+    for (int i = 0; i < len; i++) {
+        word[i] = 'a' + random() % 8 + (random() % 4 == 0 ? random() % 18 : 0);
+    }
+    word[len] = '\0';
+}
+
+/* Set game up as if the letters in guessed had been tried on word. */
+static void make_board(struct game_state *game, char *word, unsigned int guessed) {
+    int len = strlen(word);
+    memset(game->letters_guessed, 0, sizeof(game->letters_guessed));
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        game->letters_guessed[i] = (guessed >> i) & 1;
+    }
+    for (int i = 0; i < len; i++) {
+        game->guess[i] = game->letters_guessed[word[i] - 'a'] ? word[i] : '-';
+    }
+    game->guess[len] = '\0';
+    strcpy(game->word, word);
+}
+
+int main(int argc, char **argv) {
+    struct dictionary dict;
+    struct game_state game;
+    unsigned int seed = argc > 1 ? strtoul(argv[1], NULL, 10) : 1;
+
+    srandom(seed);
+    dict.fp = tmpfile();
+    if (dict.fp == NULL) {
+        perror("tmpfile");
+        exit(1);
+    }
+    for (int i = 0; i < TEST_WORDS; i++) {
+        random_word(words[i]);
+        fprintf(dict.fp, "%s\n", words[i]);
+    }
+    dict.size = TEST_WORDS;
+    if (bot_load(&dict) <= 0) {
+        exit(1);
+    }
+
+    for (int n = 0; n < TEST_BOARDS; n++) {
+        char word[MAX_WORD];
+        unsigned int guessed = 0;
+        // Most boards are for a word the bots know; some are not
+        if (n % 4 == 0) {
+            random_word(word);
+        } else {
+            strcpy(word, words[random() % TEST_WORDS]);
+        }
+        for (int i = 0; i < NUM_LETTERS; i++) {
+            if (random() % 3 == 0) {
+                guessed |= 1u << i;
+            }
+        }
+        make_board(&game, word, guessed);
+        int found = bot_check_filters(&game);
+        if (found == -1) {
+            fprintf(stderr, "Filters disagree on board %s (word %s, seed %u)\n",
+                game.guess, word, seed);
+            exit(1);
+        }
+        if (n % 4 != 0 && found == 0) {
+            fprintf(stderr, "No filter found %s on board %s (seed %u)\n",
+                word, game.guess, seed);
+            exit(1);
+        }
+    }
+    printf("Filters agree on %d boards\n", TEST_BOARDS);
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cluster.h"
+
+unsigned int get_u16(char *buf) {
+    return ((unsigned char)buf[0] << 8) | (unsigned char)buf[1];
+}
+
+unsigned int get_u32(char *buf) {
+    return (get_u16(buf) << 16) | get_u16(buf + 2);
+}
+
+void set_u16(char *buf, unsigned int v) {
+    buf[0] = (v >> 8) & 0xff;
+    buf[1] = v & 0xff;
+}
+
+void set_u32(char *buf, unsigned int v) {
+    set_u16(buf, v >> 16);
+    set_u16(buf + 2, v & 0xffff);
+}
+
+/* Return the secret that links must start with, or NULL if none is set. */
+char *link_secret() {
+    char *secret = getenv(LINK_SECRET_ENV);
+    if (secret == NULL || secret[0] == '\0') {
+        return NULL;
+    }
+    return secret;
+}
+
+/* Return 1 if the len bytes of payload are the link secret. Every byte is
+ * compared, so the time taken does not give away how much was right.
+ */
+int link_secret_matches(char *payload, int len) {
+    char *secret = link_secret();
+    if (secret == NULL || len != strlen(secret)) {
+        return 0;
+    }
+    unsigned char diff = 0;
+    for (int i = 0; i < len; i++) {
+        diff |= payload[i] ^ secret[i];
+    }
+    return diff == 0;
+}
+
+/* Send one frame on a link. The header and payload go out in a single
+ * write so frames from different streams never interleave.
+ * Returns -1 if the write failed or the payload is too big.
+ */
+int link_send(int fd, int type, unsigned int stream, char *payload, int len) {
+    char frame[LINK_BUF];
+    if (LINK_HEADER + len > LINK_BUF) {
+        fprintf(stderr, "Link frame of %d bytes is too long\n", len);
+        return -1;
+    }
+    frame[0] = type;
+    set_u32(frame + 1, stream);
+    set_u16(frame + 5, len);
+    memcpy(frame + LINK_HEADER, payload, len);
+    if (write(fd, frame, LINK_HEADER + len) != LINK_HEADER + len) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Look for a whole frame at the start of the len bytes in buf. If there
+ * is one, fill in its fields and return its length so the caller can
+ * discard it. Returns 0 if more bytes are needed and -1 if the frame
+ * can never fit in LINK_BUF.
+ */
+int link_next_frame(char *buf, int len, int *type, unsigned int *stream,
+    char **payload, int *payload_len) {
+    if (len < LINK_HEADER) {
+        return 0;
+    }
+    int size = LINK_HEADER + get_u16(buf + 5);
+    if (size > LINK_BUF) {
+        return -1;
+    }
+    if (len < size) {
+        return 0;
+    }
+    *type = (unsigned char)buf[0];
+    *stream = get_u32(buf + 1);
+    *payload = buf + LINK_HEADER;
+    *payload_len = size - LINK_HEADER;
+    return size;
+}
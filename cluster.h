@@ -0,0 +1,83 @@
+#ifndef _CLUSTER_H_
+#define _CLUSTER_H_
+
+#include <sys/select.h>
+#include "gameplay.h"
+
+/* Gateway to node links
+ *
+ * The gateway (gateway.c) keeps one connection to each wordsrv node and
+ * sends the traffic of all its clients for that node over it. To the
+ * node, the connection looks like a new client whose first byte is
+ * LINK_MAGIC. Links carry whole games and choose client addresses, so
+ * the gateway must then prove it knows the secret shared by the cluster,
+ * taken from the environment variable LINK_SECRET_ENV, with a LINK_HELLO.
+ * Nodes with no secret set refuse links. Once the secret checks out the
+ * node answers with LINK_MAGIC, and both sides then exchange frames.
+ *
+ * Every frame is a 1 byte type, a 4 byte stream id, a 2 byte payload
+ * length, then the payload, all in network order. A stream is one client
+ * connection to the gateway. Stream ids are below FD_SETSIZE and unique
+ * among the gateway's open streams.
+ *
+ * Gateway to node:
+ *   LINK_HELLO       the shared secret              first frame, and only then
+ *   LINK_OPEN        u32 client address, room id    a client has joined
+ *   LINK_DATA        bytes from the client
+ *   LINK_CLOSE       the client has gone
+ *   LINK_PING        health check (stream 0)
+ *   LINK_DRAIN       room id                        give the room up
+ *   LINK_ROOM_STATE  as below                       take the room over
+ * Node to gateway:
+ *   LINK_DATA        bytes for the client
+ *   LINK_CLOSE       the node dropped the client
+ *   LINK_PONG        answer to LINK_PING
+ *   LINK_ROOM_STATE  the room after LINK_DRAIN; it is no longer here
+ *
+ * LINK_ROOM_STATE holds the room id (u8 length, bytes), a u8 that is 1
+ * if a game follows, and if so the word (u8 length, bytes), the guess
+ * (same length), u32 mask of letters guessed and u8 guesses left. Then a
+ * u8 count of seats, each: u32 stream, u8 SEAT_* flags, u8 protocol,
+ * name (u8 length, bytes), resume token (TOKEN_LEN bytes, zero if none),
+ * u16 guesses made and u16 correct guesses, in turn order.
+ */
+#define LINK_MAGIC 0xC9
+
+#define LINK_OPEN 1
+#define LINK_DATA 2
+#define LINK_CLOSE 3
+#define LINK_PING 4
+#define LINK_PONG 5
+#define LINK_DRAIN 6
+#define LINK_ROOM_STATE 7
+#define LINK_HELLO 8
+
+#define LINK_SECRET_ENV "WORDSRV_LINK_SECRET"
+
+#define SEAT_HAS_TURN 1       // It is this player's turn
+#define SEAT_NEW 2            // The client has not entered a name yet
+
+#define LINK_HEADER 7
+#define LINK_BUF 8192         // Largest frame, header included
+
+/* The node's end of a link from a gateway */
+struct link {
+    int fd;
+    char inbuf[LINK_BUF];
+    int in_len;
+    int authed;                          // LINK_HELLO had the right secret
+    struct client *streams[FD_SETSIZE];  // Clients by stream id
+    struct link *next;
+};
+
+int link_send(int fd, int type, unsigned int stream, char *payload, int len);
+int link_next_frame(char *buf, int len, int *type, unsigned int *stream,
+    char **payload, int *payload_len);
+char *link_secret();
+int link_secret_matches(char *payload, int len);
+unsigned int get_u32(char *buf);
+unsigned int get_u16(char *buf);
+void set_u32(char *buf, unsigned int v);
+void set_u16(char *buf, unsigned int v);
+
+#endif
@@ -4,11 +4,13 @@
 #include <string.h>
 
 #include "gameplay.h"
+#include "trace.h"
 
 /* Return a status message that shows the current state of the game.
  * Assumes that the caller has allocated MAX_MSG bytes for msg.
  */
 char *status_message(char *msg, struct game_state *game) {
+    TRACE_SCOPE("status_message");
     sprintf(msg, "***************\r\n"
            "Word to guess: %s\r\nGuesses remaining: %d\r\n"
            "Letters guessed: \r\n", game->guess, game->guesses_left);
@@ -33,8 +35,11 @@ char *status_message(char *msg, struct game_state *game) {
  * We can't initialize head and has_next_turn because these will have
  * different values when we use init_game to create a new game after one
  * has already been played
+ * The same goes for version and the spectators, which carry over between
+ * games; we only bump version since the board is new.
  */
 void init_game(struct game_state *game, char *dict_name) {
+    TRACE_SCOPE("init_game");
     char buf[MAX_WORD];
     if(game->dict.fp != NULL) {
         rewind(game->dict.fp);
@@ -72,6 +77,9 @@ void init_game(struct game_state *game, char *dict_name) {
         game->letters_guessed[i] = 0;
     }
     game->guesses_left = MAX_GUESSES;
+    game->delta_letter = '\0';
+    game->delta_positions = 0;
+    game->version++;
 
 }
 
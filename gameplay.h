@@ -1,4 +1,11 @@
+#ifndef _GAMEPLAY_H_
+#define _GAMEPLAY_H_
+
+#include <stdio.h>
 #include <netinet/in.h>
+#include <sys/time.h>
+
+#include "ratelimit.h"
 
 #define MAX_NAME 30  
 #define MAX_MSG 128
@@ -6,15 +13,34 @@
 #define MAX_BUF 256
 #define MAX_GUESSES 4
 #define NUM_LETTERS 26
+#define TOKEN_LEN 16
+#define MAX_ROOM 32           // Room ids, including the terminating '\0'
 #define WELCOME_MSG "Welcome to our word game. What is your name? "
 
+struct game_state;
+struct link;
+
 struct client {
-    int fd;
+    int fd;               // Negative for clients reached through a link
     struct in_addr ipaddr;
     struct client *next;
     char name[MAX_NAME];
     char inbuf[MAX_BUF];  // Used to hold input from the client
     char *in_ptr;         // A pointer into inbuf to help with partial reads
+    int guesses_made;     // Guesses this player made in the current game
+    int correct_guesses;  // How many of those guesses revealed a letter
+    struct token_bucket bucket;  // Limits how fast the client sends lines
+    int strikes;          // Lines dropped since the client was last paused
+    int paused;           // 1 while we are not reading from the client
+    struct timeval paused_until;
+    char token[TOKEN_LEN + 1];  // Lets the player reclaim their seat
+    int detached;         // 1 if the connection dropped and fd is -1
+    struct timeval detached_until;
+    int proto;            // PROTO_TEXT or PROTO_BINARY (see protocol.h)
+    struct game_state *game;  // The room the client is in or will join
+    struct link *link;    // The gateway link the client is behind, or NULL
+    unsigned int stream;  // The client's stream on that link
+    int bot;              // 1 for a bot played by the server (see bot.h)
 };
 
 // Information about the dictionary used to pick random word
@@ -23,19 +49,45 @@ struct dictionary {
     int size;
 };
 
+struct spectator;
+
+/* The state of one room. Each room plays its own game. */
 struct game_state {
+    char room[MAX_ROOM];      // The room id; "" for the default room
+    struct game_state *next_room;
+    int results_pending;      // A game ended and its stats are queued
+
     char word[MAX_WORD];      // The word to guess
     char guess[MAX_WORD];     // The current guess (for example '-o-d')
     int letters_guessed[NUM_LETTERS]; // Index i will be 1 if the corresponding
                                       // letter has been guessed; 0 otherwise
     int guesses_left;         // Number of guesses remaining
+    char delta_letter;        // The last letter guessed, and a mask of the
+    unsigned int delta_positions; // positions in guess it revealed
     struct dictionary dict;
     
     struct client *head;
     struct client *has_next_turn;
+    struct timeval bot_due;   // When the bot with the turn will guess
+
+    int version;              // Bumped whenever the board or turn changes
+
+    // Spectators are sent a cached copy of the board (see spectator.c)
+    struct spectator *spectators;
+    char snapshot[MAX_BUF];   // The board as last rendered for spectators
+    int snapshot_len;
+    char snapshot_frame[MAX_BUF]; // The same for binary spectators
+    int snapshot_frame_len;
+    int snapshot_version;     // version that snapshot was rendered from
+    int fanout_version;       // version when spectators were last updated
+    int spectators_behind;    // Spectators that missed the last update
+    struct timeval last_fanout;
+    struct timeval last_hangup_check;
 };
 
 
 void init_game(struct game_state *game, char *dict_name);
 int get_file_length(char *filename);
-char *status_message(char *msg, struct game_state *game);
\ No newline at end of file
+char *status_message(char *msg, struct game_state *game);
+
+#endif
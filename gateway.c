@@ -0,0 +1,697 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "socket.h"
+#include "cluster.h"
+
+/* wordgw: a gateway in front of several wordsrv nodes.
+ *
+ * Clients connect to the gateway and name a room. Each room lives on one
+ * node, picked by consistent hashing on the room id, and everything the
+ * client sends or receives is passed over the gateway's link to that node
+ * (see cluster.h). Nodes are pinged and, if one stops answering, the
+ * clients in its rooms are disconnected. "drain N" on standard input
+ * moves all rooms off node N without disconnecting anybody.
+ *
+ * Nothing here waits on a single peer: nodes are connected to in the
+ * background, and what a client is too slow to take is kept for it
+ * until its socket drains, up to CLIENT_OUT_BUF bytes.
+ */
+
+#define MAX_QUEUE 5
+#define MAX_NODES 16
+#define VNODES 64             // Points on the ring for each node
+#define PING_MS 1000          // How often nodes are pinged
+#define DEAD_MS 3000          // Silence after which a node is down
+#define CLIENT_OUT_BUF 16384  // Output kept for a slow client before it is dropped
+
+#define ROOM_PROMPT "Which room? (empty line for the default room)\r\n"
+#define NODE_GONE_MSG "The server for this room has gone away.\r\n"
+
+struct node {
+    char host[64];
+    int port;
+    struct sockaddr_in addr;
+    int fd;                   // -1 while the node is down
+    int connecting;           // A connection to the node has been started
+    int linked;               // The node has answered LINK_MAGIC
+    int draining;
+    struct timeval last_pong;
+    char inbuf[LINK_BUF];
+    int in_len;
+};
+
+/* Where a room is being played. Rooms are forgotten when their last
+ * client leaves, so the next client is sent wherever the ring says.
+ */
+struct route {
+    char id[MAX_ROOM];
+    int node;
+    int streams;              // Clients in the room
+    int moving;               // Drained; waiting for its LINK_ROOM_STATE
+    struct route *next;
+};
+
+struct gw_client {
+    int fd;                   // Also the stream id on the link
+    struct in_addr addr;
+    struct route *route;      // NULL until the client has named a room
+    int opened;               // LINK_OPEN has been sent to the node
+    char inbuf[MAX_ROOM + 2];
+    int in_len;
+    char outbuf[CLIENT_OUT_BUF];  // What the client has not taken yet
+    int out_len;
+};
+
+struct point {
+    unsigned int hash;
+    int node;
+};
+
+struct node nodes[MAX_NODES];
+int num_nodes = 0;
+struct point ring[MAX_NODES * VNODES];
+struct route *routes = NULL;
+struct gw_client *clients[FD_SETSIZE];
+fd_set allset;
+fd_set writeset;              // Nodes being connected to, clients with output
+int maxfd;
+
+void close_client(struct gw_client *c, char *msg);
+void drop_client(struct gw_client *c);
+
+
+static unsigned int hash_string(char *s) {
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    // FNV alone spreads short similar strings poorly around the ring
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    return h;
+}
+
+static int compare_points(const void *a, const void *b) {
+    unsigned int x = ((struct point *)a)->hash;
+    unsigned int y = ((struct point *)b)->hash;
+    return (x > y) - (x < y);
+}
+
+/* Put VNODES points for every node on the ring, so that adding or
+ * removing a node only moves the rooms next to its points.
+ */
+void build_ring() {
+    char key[128];
+    for (int i = 0; i < num_nodes; i++) {
+        for (int v = 0; v < VNODES; v++) {
+            snprintf(key, sizeof(key), "%s:%d#%d", nodes[i].host, nodes[i].port, v);
+            ring[i * VNODES + v].hash = hash_string(key);
+            ring[i * VNODES + v].node = i;
+        }
+    }
+    qsort(ring, num_nodes * VNODES, sizeof(struct point), compare_points);
+}
+
+/* Return the node a room belongs on: the owner of the first point at or
+ * after the room's hash, skipping nodes that are down or draining.
+ * Returns -1 if no node can take it.
+ */
+int pick_node(char *id) {
+    int n = num_nodes * VNODES;
+    unsigned int h = hash_string(id);
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        struct node *nd = &nodes[ring[(lo + i) % n].node];
+        if (nd->linked && !nd->draining) {
+            return ring[(lo + i) % n].node;
+        }
+    }
+    return -1;
+}
+
+struct route *find_route(char *id) {
+    struct route *r;
+    for (r = routes; r != NULL && strcmp(r->id, id) != 0; r = r->next);
+    return r;
+}
+
+void drop_route(struct route *r) {
+    struct route **q;
+    for (q = &routes; *q != r; q = &(*q)->next);
+    *q = r->next;
+    free(r);
+}
+
+/* Start connecting to node i. The link is set up by node_connected once
+ * select says the attempt is over.
+ */
+void connect_node(int i) {
+    struct node *nd = &nodes[i];
+    int fd = start_connect(&nd->addr);
+    if (fd == -1) {
+        return;
+    }
+    if (fd >= FD_SETSIZE) {
+        close(fd);
+        return;
+    }
+    nd->fd = fd;
+    nd->connecting = 1;
+    nd->linked = 0;
+    nd->in_len = 0;
+    // A node that never answers is given up on like one that stops
+    gettimeofday(&nd->last_pong, NULL);
+    FD_SET(fd, &writeset);
+    if (fd > maxfd) {
+        maxfd = fd;
+    }
+}
+
+/* The connection to node i has been made or has failed. If made, send
+ * the node the link secret. The node first greets us as it would any
+ * client, so its answer is found in read_node.
+ */
+void node_connected(int i) {
+    struct node *nd = &nodes[i];
+    unsigned char magic = LINK_MAGIC;
+    char *secret = link_secret();
+    FD_CLR(nd->fd, &writeset);
+    nd->connecting = 0;
+    if (finish_connect(nd->fd) == -1 || write(nd->fd, &magic, 1) != 1
+        || link_send(nd->fd, LINK_HELLO, 0, secret, strlen(secret)) == -1) {
+        close(nd->fd);
+        nd->fd = -1;
+        return;
+    }
+    printf("Connected to node %d %s:%d\n", i, nd->host, nd->port);
+    FD_SET(nd->fd, &allset);
+}
+
+/* Node i stopped answering. Its rooms are gone with it, so their clients
+ * are told and disconnected; the node is reconnected to later.
+ */
+void node_down(int i) {
+    struct node *nd = &nodes[i];
+    printf("Node %d %s:%d is down\n", i, nd->host, nd->port);
+    FD_CLR(nd->fd, &allset);
+    FD_CLR(nd->fd, &writeset);
+    close(nd->fd);
+    nd->fd = -1;
+    nd->connecting = 0;
+    nd->linked = 0;
+    for (int fd = 0; fd < FD_SETSIZE; fd++) {
+        struct gw_client *c = clients[fd];
+        if (c != NULL && c->route != NULL && c->route->node == i) {
+            close_client(c, NODE_GONE_MSG);
+        }
+    }
+}
+
+/* Send a frame to node i, treating a failed write as the node going down.
+ * Returns -1 in that case.
+ */
+int send_node(int i, int type, unsigned int stream, char *payload, int len) {
+    if (link_send(nodes[i].fd, type, stream, payload, len) == -1) {
+        node_down(i);
+        return -1;
+    }
+    return 0;
+}
+
+/* Tell the room's node that c has joined. */
+void open_client(struct gw_client *c) {
+    char payload[4 + MAX_ROOM];
+    int len = strlen(c->route->id);
+    set_u32(payload, ntohl(c->addr.s_addr));
+    memcpy(payload + 4, c->route->id, len);
+    c->opened = 1;
+    send_node(c->route->node, LINK_OPEN, c->fd, payload, 4 + len);
+}
+
+/* Disconnect c, after sending it msg if msg is not NULL. Output it has
+ * not taken yet is thrown away, and msg is only sent if it fits now.
+ */
+void close_client(struct gw_client *c, char *msg) {
+    printf("Closing client %d %s\n", c->fd, inet_ntoa(c->addr));
+    if (msg != NULL && c->out_len == 0
+        && send(c->fd, msg, strlen(msg), MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+        fprintf(stderr, "Write to client %s failed\n", inet_ntoa(c->addr));
+    }
+    clients[c->fd] = NULL;
+    FD_CLR(c->fd, &allset);
+    FD_CLR(c->fd, &writeset);
+    close(c->fd);
+    if (c->route != NULL && --c->route->streams == 0) {
+        drop_route(c->route);
+    }
+    free(c);
+}
+
+/* c has gone, or can't keep up with its room: tell the node, if it
+ * knows of c, and disconnect it.
+ */
+void drop_client(struct gw_client *c) {
+    int fd = c->fd;
+    if (c->opened) {
+        send_node(c->route->node, LINK_CLOSE, fd, NULL, 0);
+    }
+    // If that send failed, node_down has closed c already
+    if (clients[fd] == c) {
+        close_client(c, NULL);
+    }
+}
+
+/* Send what c has waiting without blocking, keeping whatever its socket
+ * won't take for later. Returns -1 if c was dropped.
+ */
+int flush_client(struct gw_client *c) {
+    int sent = send(c->fd, c->outbuf, c->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        fprintf(stderr, "Write to client %s failed\n", inet_ntoa(c->addr));
+        drop_client(c);
+        return -1;
+    }
+    if (sent > 0) {
+        c->out_len -= sent;
+        memmove(c->outbuf, c->outbuf + sent, c->out_len);
+    }
+    if (c->out_len > 0) {
+        FD_SET(c->fd, &writeset);
+    } else {
+        FD_CLR(c->fd, &writeset);
+    }
+    return 0;
+}
+
+/* Queue len bytes for c and send as much as it will take. A client that
+ * has fallen CLIENT_OUT_BUF bytes behind is dropped rather than waited on.
+ * Returns -1 if c was dropped.
+ */
+int send_client(struct gw_client *c, char *buf, int len) {
+    if (c->out_len + len > CLIENT_OUT_BUF) {
+        fprintf(stderr, "Client %s is too slow, dropping it\n", inet_ntoa(c->addr));
+        drop_client(c);
+        return -1;
+    }
+    memcpy(c->outbuf + c->out_len, buf, len);
+    c->out_len += len;
+    return flush_client(c);
+}
+
+/* Give up node i's rooms: each is sent LINK_DRAIN, and its clients are
+ * not read from until the room has been moved.
+ */
+void drain_node(int i) {
+    struct route *r;
+    nodes[i].draining = 1;
+    printf("Draining node %d\n", i);
+    if (!nodes[i].linked) {
+        return;
+    }
+    for (r = routes; r != NULL; r = r->next) {
+        if (r->node == i && !r->moving) {
+            r->moving = 1;
+            if (send_node(i, LINK_DRAIN, 0, r->id, strlen(r->id)) == -1) {
+                // node_down has closed the rooms already
+                return;
+            }
+        }
+    }
+    for (int fd = 0; fd < FD_SETSIZE; fd++) {
+        if (clients[fd] != NULL && clients[fd]->route != NULL && clients[fd]->route->moving) {
+            FD_CLR(fd, &allset);
+        }
+    }
+}
+
+/* A drained node sent back one of its rooms. Pass it on to the room's
+ * new node and start reading from its clients again.
+ */
+void move_room(int from, char *payload, int len) {
+    char id[MAX_ROOM];
+    int id_len = (unsigned char)payload[0];
+    if (len < 1 + id_len || id_len >= MAX_ROOM) {
+        fprintf(stderr, "Node %d sent a bad room state\n", from);
+        return;
+    }
+    memcpy(id, payload + 1, id_len);
+    id[id_len] = '\0';
+    struct route *r = find_route(id);
+    if (r == NULL) {
+        // Everybody left while it was moving
+        return;
+    }
+
+    int to = pick_node(id);
+    r->moving = 0;
+    if (to == -1 || send_node(to, LINK_ROOM_STATE, 0, payload, len) == -1) {
+        fprintf(stderr, "No node can take room \"%s\"\n", id);
+        r->node = from;
+        for (int fd = 0; fd < FD_SETSIZE; fd++) {
+            if (clients[fd] != NULL && clients[fd]->route == r) {
+                close_client(clients[fd], NODE_GONE_MSG);
+            }
+        }
+        return;
+    }
+    printf("Room \"%s\" moved from node %d to node %d\n", id, from, to);
+    r->node = to;
+    for (int fd = 0; fd < FD_SETSIZE; fd++) {
+        struct gw_client *c = clients[fd];
+        if (c != NULL && c->route == r) {
+            FD_SET(fd, &allset);
+            if (!c->opened) {
+                open_client(c);
+            }
+        }
+    }
+}
+
+/* Read from node i and handle every whole frame it sent. */
+void read_node(int i) {
+    struct node *nd = &nodes[i];
+    int readcnt = read(nd->fd, nd->inbuf + nd->in_len, LINK_BUF - nd->in_len);
+    if (readcnt <= 0) {
+        node_down(i);
+        return;
+    }
+    nd->in_len += readcnt;
+
+    if (!nd->linked) {
+        // Skip the welcome message up to the node's LINK_MAGIC
+        char *ack = memchr(nd->inbuf, LINK_MAGIC, nd->in_len);
+        if (ack == NULL) {
+            nd->in_len = 0;
+            return;
+        }
+        nd->in_len -= ack + 1 - nd->inbuf;
+        memmove(nd->inbuf, ack + 1, nd->in_len);
+        nd->linked = 1;
+        printf("Linked to node %d\n", i);
+    }
+
+    int type, len, size;
+    unsigned int stream;
+    char *payload;
+    while ((size = link_next_frame(nd->inbuf, nd->in_len, &type, &stream, &payload, &len)) != 0) {
+        if (size == -1) {
+            fprintf(stderr, "Bad frame from node %d\n", i);
+            node_down(i);
+            return;
+        }
+        struct gw_client *c = stream < FD_SETSIZE ? clients[stream] : NULL;
+        if (type == LINK_PONG) {
+            gettimeofday(&nd->last_pong, NULL);
+        } else if (type == LINK_ROOM_STATE) {
+            move_room(i, payload, len);
+        } else if (c != NULL && c->route != NULL && c->route->node == i) {
+            if (type == LINK_DATA) {
+                send_client(c, payload, len);
+            } else if (type == LINK_CLOSE) {
+                c->opened = 0;
+                close_client(c, NULL);
+            }
+        }
+        // The node may have gone down while handling the frame
+        if (nd->fd == -1) {
+            return;
+        }
+        nd->in_len -= size;
+        memmove(nd->inbuf, nd->inbuf + size, nd->in_len);
+    }
+}
+
+/* Read from a client. Until it has named a room the input is the room
+ * id; after that it is passed to the room's node unchanged.
+ */
+void read_client(struct gw_client *c) {
+    char buf[LINK_BUF - LINK_HEADER];
+    int readcnt = read(c->fd, buf, sizeof(buf));
+    if (readcnt <= 0) {
+        drop_client(c);
+        return;
+    }
+    if (c->route != NULL) {
+        send_node(c->route->node, LINK_DATA, c->fd, buf, readcnt);
+        return;
+    }
+
+    int n = sizeof(c->inbuf) - c->in_len;
+    if (n > readcnt) {
+        n = readcnt;
+    }
+    memcpy(c->inbuf + c->in_len, buf, n);
+    c->in_len += n;
+    char *end = memchr(c->inbuf, '\n', c->in_len);
+    if (end == NULL) {
+        if (c->in_len == sizeof(c->inbuf)) {
+            close_client(c, "That room name is too long.\r\n");
+        }
+        return;
+    }
+    int id_len = end - c->inbuf;
+    if (id_len > 0 && c->inbuf[id_len - 1] == '\r') {
+        id_len--;
+    }
+    if (id_len >= MAX_ROOM) {
+        close_client(c, "That room name is too long.\r\n");
+        return;
+    }
+    char id[MAX_ROOM];
+    memcpy(id, c->inbuf, id_len);
+    id[id_len] = '\0';
+
+    struct route *r = find_route(id);
+    if (r == NULL) {
+        int i = pick_node(id);
+        if (i == -1) {
+            close_client(c, "No servers are available.\r\n");
+            return;
+        }
+        r = malloc(sizeof(struct route));
+        if (!r) {
+            perror("malloc");
+            exit(1);
+        }
+        strcpy(r->id, id);
+        r->node = i;
+        r->streams = 0;
+        r->moving = 0;
+        r->next = routes;
+        routes = r;
+    }
+    r->streams++;
+    c->route = r;
+    printf("Client %d joins room \"%s\" on node %d\n", c->fd, id, r->node);
+    if (r->moving) {
+        // Opened on the room's new node once it gets there
+        FD_CLR(c->fd, &allset);
+        return;
+    }
+    int fd = c->fd;
+    open_client(c);
+
+    // Anything typed after the room name belongs to the game
+    int rest = (c->inbuf + c->in_len) - (end + 1);
+    if (rest > 0 && clients[fd] == c) {
+        send_node(r->node, LINK_DATA, fd, end + 1, rest);
+    }
+    if (readcnt > n && clients[fd] == c) {
+        send_node(r->node, LINK_DATA, fd, buf + n, readcnt - n);
+    }
+}
+
+/* Handle an operator command from standard input. */
+void read_command() {
+    char line[128];
+    int i;
+    if (fgets(line, sizeof(line), stdin) == NULL) {
+        FD_CLR(STDIN_FILENO, &allset);
+        return;
+    }
+    if (sscanf(line, "drain %d", &i) == 1 && i >= 0 && i < num_nodes) {
+        drain_node(i);
+    } else if (sscanf(line, "undrain %d", &i) == 1 && i >= 0 && i < num_nodes) {
+        nodes[i].draining = 0;
+        printf("Node %d takes new rooms again\n", i);
+    } else if (strncmp(line, "status", 6) == 0) {
+        for (i = 0; i < num_nodes; i++) {
+            printf("node %d %s:%d %s%s\n", i, nodes[i].host, nodes[i].port,
+                nodes[i].linked ? "up" : "down", nodes[i].draining ? " draining" : "");
+        }
+        for (struct route *r = routes; r != NULL; r = r->next) {
+            printf("room \"%s\" node %d clients %d%s\n", r->id, r->node, r->streams,
+                r->moving ? " moving" : "");
+        }
+    } else {
+        printf("Commands: drain N, undrain N, status\n");
+    }
+}
+
+/* Ping every node, give up on those that have not answered for DEAD_MS,
+ * and try to reconnect to those that are down.
+ */
+void check_nodes() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    for (int i = 0; i < num_nodes; i++) {
+        struct node *nd = &nodes[i];
+        if (nd->fd == -1) {
+            connect_node(i);
+            continue;
+        }
+        long silent = (now.tv_sec - nd->last_pong.tv_sec) * 1000
+            + (now.tv_usec - nd->last_pong.tv_usec) / 1000;
+        if (nd->connecting) {
+            if (silent > DEAD_MS) {
+                printf("Node %d %s:%d did not answer\n", i, nd->host, nd->port);
+                FD_CLR(nd->fd, &writeset);
+                close(nd->fd);
+                nd->fd = -1;
+                nd->connecting = 0;
+            }
+        } else if (silent > DEAD_MS) {
+            node_down(i);
+        } else if (nd->linked) {
+            send_node(i, LINK_PING, 0, NULL, 0);
+        }
+    }
+}
+
+
+int main(int argc, char **argv) {
+    struct sockaddr_in q;
+    fd_set rset, wset;
+
+    if (argc < 3 || argc - 2 > MAX_NODES) {
+        fprintf(stderr, "Usage: %s <port> <node port or host:port>...\n", argv[0]);
+        exit(1);
+    }
+    if (link_secret() == NULL) {
+        fprintf(stderr, "Set %s to the secret the nodes were started with\n",
+            LINK_SECRET_ENV);
+        exit(1);
+    }
+    // A node that goes away mid write must not take the gateway with it
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 2; i < argc; i++) {
+        struct node *nd = &nodes[num_nodes++];
+        char *colon = strchr(argv[i], ':');
+        if (colon != NULL) {
+            snprintf(nd->host, sizeof(nd->host), "%.*s", (int)(colon - argv[i]), argv[i]);
+            nd->port = strtol(colon + 1, NULL, 10);
+        } else {
+            strcpy(nd->host, "127.0.0.1");
+            nd->port = strtol(argv[i], NULL, 10);
+        }
+        if (resolve_host(nd->host, nd->port, &nd->addr) == -1) {
+            exit(1);
+        }
+        nd->fd = -1;
+        nd->connecting = 0;
+        nd->draining = 0;
+    }
+    build_ring();
+
+    struct sockaddr_in *server = init_server_addr(strtol(argv[1], NULL, 10));
+    int listenfd = set_up_server_socket(server, MAX_QUEUE);
+    FD_ZERO(&allset);
+    FD_ZERO(&writeset);
+    FD_SET(listenfd, &allset);
+    FD_SET(STDIN_FILENO, &allset);
+    maxfd = listenfd;
+    check_nodes();
+
+    struct timeval last_check;
+    gettimeofday(&last_check, NULL);
+    while (1) {
+        struct timeval now, timeout = {0, PING_MS * 1000};
+        rset = allset;
+        wset = writeset;
+        if (select(maxfd + 1, &rset, &wset, NULL, &timeout) == -1) {
+            perror("select");
+            continue;
+        }
+        gettimeofday(&now, NULL);
+        if ((now.tv_sec - last_check.tv_sec) * 1000
+            + (now.tv_usec - last_check.tv_usec) / 1000 >= PING_MS) {
+            check_nodes();
+            last_check = now;
+        }
+
+        if (FD_ISSET(listenfd, &rset)) {
+            int fd = accept_connection(listenfd, &q);
+            if (fd >= FD_SETSIZE) {
+                fprintf(stderr, "Too many connections, refusing fd %d\n", fd);
+                close(fd);
+            } else {
+                struct gw_client *c = malloc(sizeof(struct gw_client));
+                if (!c) {
+                    perror("malloc");
+                    exit(1);
+                }
+                c->fd = fd;
+                c->addr = q.sin_addr;
+                c->route = NULL;
+                c->opened = 0;
+                c->in_len = 0;
+                c->out_len = 0;
+                clients[fd] = c;
+                FD_SET(fd, &allset);
+                if (fd > maxfd) {
+                    maxfd = fd;
+                }
+                send_client(c, ROOM_PROMPT, strlen(ROOM_PROMPT));
+            }
+        }
+        if (FD_ISSET(STDIN_FILENO, &rset)) {
+            read_command();
+        }
+
+        for (int fd = 0; fd <= maxfd; fd++) {
+            if (fd == listenfd || fd == STDIN_FILENO) {
+                continue;
+            }
+            int i;
+            for (i = 0; i < num_nodes && nodes[i].fd != fd; i++);
+            // Anything handled here can close other descriptors, so each
+            // is looked up again, and only acted on if it is still wanted
+            if (FD_ISSET(fd, &wset)) {
+                if (i < num_nodes && nodes[i].connecting) {
+                    node_connected(i);
+                } else if (i == num_nodes && clients[fd] != NULL
+                    && FD_ISSET(fd, &writeset)) {
+                    flush_client(clients[fd]);
+                }
+            }
+            if (FD_ISSET(fd, &rset) && FD_ISSET(fd, &allset)) {
+                if (i < num_nodes && nodes[i].fd == fd) {
+                    read_node(i);
+                } else if (clients[fd] != NULL) {
+                    read_client(clients[fd]);
+                }
+            }
+        }
+    }
+    return 0;
+}
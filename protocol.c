@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+#include "cluster.h"
+#include "trace.h"
+
+/* Store v in buf in network order. */
+static void put_u16(char *buf, unsigned int v) {
+    buf[0] = (v >> 8) & 0xff;
+    buf[1] = v & 0xff;
+}
+
+static void put_u32(char *buf, unsigned int v) {
+    put_u16(buf, v >> 16);
+    put_u16(buf + 2, v & 0xffff);
+}
+
+/* Fill in the header of the frame whose payload of len bytes has already
+ * been written after it. Returns the length of the whole frame.
+ */
+static int finish_frame(char *frame, int type, int len) {
+    frame[0] = type;
+    put_u16(frame + 1, len);
+    return FRAME_HEADER + len;
+}
+
+/* Return a mask with bit i set if letter 'a' + i has been guessed. */
+static unsigned int letters_mask(struct game_state *game) {
+    unsigned int mask = 0;
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        if (game->letters_guessed[i]) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+/* Take the first FRAME_JOIN or FRAME_GUESS out of what is already in
+ * inbuf and copy its payload into newline. Other frame types are
+ * skipped. Returns 0 if a frame was found, 1 if inbuf does not hold a
+ * whole one yet, and -1 if the next frame is too big to buffer.
+ */
+int next_frame(struct client *p, char *newline) {
+    while (1) {
+        int len = p->in_ptr - p->inbuf;
+        if (len < FRAME_HEADER) {
+            return 1;
+        }
+        int type = (unsigned char)p->inbuf[0];
+        int payload = ((unsigned char)p->inbuf[1] << 8) | (unsigned char)p->inbuf[2];
+        if (FRAME_HEADER + payload > MAX_BUF) {
+            fprintf(stderr, "[%d] Frame of %d bytes is too long\n", p->fd, payload);
+            return -1;
+        }
+        if (len < FRAME_HEADER + payload) {
+            return 1;
+        }
+        memcpy(newline, p->inbuf + FRAME_HEADER, payload);
+        newline[payload] = '\0';
+        // move remaining bytes
+        memmove(p->inbuf, p->inbuf + FRAME_HEADER + payload,
+            len - FRAME_HEADER - payload);
+        p->in_ptr -= FRAME_HEADER + payload;
+        if (type == FRAME_JOIN || type == FRAME_GUESS) {
+            return 0;
+        }
+    }
+}
+
+/* Read whatever a binary client has sent so far, without waiting for
+ * more, and take the first FRAME_JOIN or FRAME_GUESS out of inbuf as
+ * next_frame does. Returns 0 if there was one, 1 if no whole frame has
+ * arrived yet, and -1 if the client closed or sent a frame too big to
+ * buffer, like read_newline.
+ */
+int read_frame(struct client *p, char *newline) {
+    TRACE_SCOPE("read_frame");
+    int len = p->in_ptr - p->inbuf;
+    // A full inbuf holds a whole frame already, since bigger ones are refused
+    if (len < MAX_BUF) {
+        int readcnt = recv(p->fd, p->in_ptr, MAX_BUF - len, MSG_DONTWAIT);
+        if (readcnt == 0 || (readcnt == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            printf("[%d] Read 0 bytes\n", p->fd);
+            return -1;
+        }
+        if (readcnt > 0) {
+            p->in_ptr += readcnt;
+        }
+    }
+    return next_frame(p, newline);
+}
+
+/* Write len bytes to p, through its gateway link if it has one. */
+int write_raw(struct client *p, char *buf, int len) {
+    // Bots have nowhere to send to, and only look at the board
+    if (p->bot) {
+        return len;
+    }
+    if (p->link != NULL) {
+        return link_send(p->link->fd, LINK_DATA, p->stream, buf, len);
+    }
+    return write(p->fd, buf, len);
+}
+
+/* Send a message to p in whichever protocol it uses: text to a text
+ * client, and frame to a binary one. If frame is NULL a binary client
+ * gets text wrapped in a FRAME_TEXT. Returns -1 if the write failed.
+ */
+int write_typed(struct client *p, char *text, char *frame, int frame_len) {
+    if (p->proto != PROTO_BINARY) {
+        return write_raw(p, text, strlen(text));
+    }
+    if (frame == NULL) {
+        char buf[MAX_FRAME];
+        return write_raw(p, buf, text_frame(buf, text));
+    }
+    return write_raw(p, frame, frame_len);
+}
+
+/* Send a text message that has no frame type of its own to p. */
+int write_to_client(struct client *p, char *text) {
+    return write_typed(p, text, NULL, 0);
+}
+
+int text_frame(char *frame, char *text) {
+    int len = strlen(text);
+    memcpy(frame + FRAME_HEADER, text, len);
+    return finish_frame(frame, FRAME_TEXT, len);
+}
+
+int join_frame(char *frame, struct client *p) {
+    int len = strlen(p->name);
+    memcpy(frame + FRAME_HEADER, p->name, len);
+    return finish_frame(frame, FRAME_JOIN, len);
+}
+
+int guess_frame(char *frame, struct client *p, char letter, int correct) {
+    char *payload = frame + FRAME_HEADER;
+    int len = strlen(p->name);
+    payload[0] = letter;
+    payload[1] = correct;
+    memcpy(payload + 2, p->name, len);
+    return finish_frame(frame, FRAME_GUESS, 2 + len);
+}
+
+/* The whole board, sent when a game starts or a player (re)joins. */
+int board_frame(char *frame, struct game_state *game) {
+    char *payload = frame + FRAME_HEADER;
+    int len = strlen(game->guess);
+    payload[0] = game->guesses_left;
+    put_u32(payload + 1, letters_mask(game));
+    memcpy(payload + 5, game->guess, len);
+    return finish_frame(frame, FRAME_BOARD, 5 + len);
+}
+
+/* What the last guess changed, sent after each turn in place of the
+ * board. The client applies it to the board it already has.
+ */
+int delta_frame(char *frame, struct game_state *game) {
+    char *payload = frame + FRAME_HEADER;
+    payload[0] = game->delta_letter;
+    put_u32(payload + 1, game->delta_positions);
+    payload[5] = game->guesses_left;
+    put_u32(payload + 6, letters_mask(game));
+    return finish_frame(frame, FRAME_DELTA, 10);
+}
+
+int turn_frame(char *frame, struct client *turn, int yours) {
+    char *payload = frame + FRAME_HEADER;
+    int len = strlen(turn->name);
+    payload[0] = yours;
+    memcpy(payload + 1, turn->name, len);
+    return finish_frame(frame, FRAME_TURN, 1 + len);
+}
+
+int game_over_frame(char *frame, struct game_state *game, int result, struct client *winner) {
+    char *payload = frame + FRAME_HEADER;
+    int word_len = strlen(game->word);
+    int len = 2 + word_len;
+    payload[0] = result;
+    payload[1] = word_len;
+    memcpy(payload + 2, game->word, word_len);
+    if (winner != NULL) {
+        int name_len = strlen(winner->name);
+        memcpy(payload + len, winner->name, name_len);
+        len += name_len;
+    }
+    return finish_frame(frame, FRAME_GAME_OVER, len);
+}
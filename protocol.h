@@ -0,0 +1,65 @@
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include "gameplay.h"
+
+/* Binary protocol
+ *
+ * A client that sends PROTO_MAGIC as its very first byte talks in frames
+ * instead of lines. The server answers with the same byte; the text
+ * greeting that was sent on connect comes before it and is ignored.
+ *
+ * Every frame is a 1 byte type, a 2 byte payload length in network
+ * order, then the payload. Integers are in network order.
+ *
+ * Client to server:
+ *   FRAME_JOIN      what would be typed at the name prompt
+ *   FRAME_GUESS     one letter
+ *
+ * Server to client:
+ *   FRAME_JOIN      name of a player who joined
+ *   FRAME_GUESS     letter, 1 if it was in the word, name of the player
+ *   FRAME_BOARD     guesses left, u32 mask of letters guessed, the guess
+ *   FRAME_DELTA     letter, u32 mask of positions it revealed, guesses
+ *                   left, u32 mask of letters guessed
+ *   FRAME_TURN      1 if it is your turn, name of the player whose it is
+ *   FRAME_GAME_OVER GAME_LOST / GAME_YOU_WON / GAME_OTHER_WON, word
+ *                   length, word, name of the winner if any
+ *   FRAME_TEXT      any other message, as the text protocol would send it
+ */
+#define PROTO_MAGIC 0xB7
+
+#define PROTO_UNKNOWN 0       // Nothing read from the client yet
+#define PROTO_TEXT 1
+#define PROTO_BINARY 2
+
+#define FRAME_JOIN 1
+#define FRAME_GUESS 2
+#define FRAME_BOARD 3
+#define FRAME_DELTA 4
+#define FRAME_TURN 5
+#define FRAME_GAME_OVER 6
+#define FRAME_TEXT 7
+
+#define GAME_LOST 0
+#define GAME_YOU_WON 1
+#define GAME_OTHER_WON 2
+
+#define FRAME_HEADER 3
+#define MAX_FRAME (FRAME_HEADER + MAX_BUF)
+
+int next_frame(struct client *p, char *newline);
+int read_frame(struct client *p, char *newline);
+int write_raw(struct client *p, char *buf, int len);
+int write_typed(struct client *p, char *text, char *frame, int frame_len);
+int write_to_client(struct client *p, char *text);
+
+int text_frame(char *frame, char *text);
+int join_frame(char *frame, struct client *p);
+int guess_frame(char *frame, struct client *p, char letter, int correct);
+int board_frame(char *frame, struct game_state *game);
+int delta_frame(char *frame, struct game_state *game);
+int turn_frame(char *frame, struct client *turn, int yours);
+int game_over_frame(char *frame, struct game_state *game, int result, struct client *winner);
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "ratelimit.h"
+#include "gameplay.h"
+
+#define IP_PROBES 4          // Slots searched before evicting the oldest
+
+/* Per address buckets. Addresses that hash to the same place share a
+ * few slots; when all are taken the least recently used one is reused,
+ * so the table never grows however many addresses connect.
+ */
+struct ip_bucket {
+    in_addr_t addr;
+    int used;
+    struct token_bucket bucket;
+};
+
+static struct ip_bucket ip_table[IP_TABLE_SIZE];
+
+struct rate_limit_stats rl_stats;
+
+
+/* Return the number of milliseconds from start to end. */
+static long elapsed_ms(struct timeval *start, struct timeval *end) {
+    return (end->tv_sec - start->tv_sec) * 1000
+        + (end->tv_usec - start->tv_usec) / 1000;
+}
+
+/* Start a bucket off full. */
+void init_bucket(struct token_bucket *b, double burst) {
+    b->tokens = burst;
+    gettimeofday(&b->last, NULL);
+}
+
+/* Refill b for the time since it was last used and take one token.
+ * Returns 1 if there was a token, 0 if the bucket is empty.
+ */
+static int take_token(struct token_bucket *b, double rate, double burst,
+    struct timeval *now) {
+    b->tokens += elapsed_ms(&b->last, now) * rate / 1000.0;
+    if (b->tokens > burst) {
+        b->tokens = burst;
+    }
+    b->last = *now;
+    if (b->tokens < 1.0) {
+        return 0;
+    }
+    b->tokens -= 1.0;
+    return 1;
+}
+
+/* Return the bucket for addr, taking over a slot if it has none. */
+static struct token_bucket *find_ip_bucket(in_addr_t addr) {
+    unsigned int h = (addr * 2654435761u) & (IP_TABLE_SIZE - 1);
+    struct ip_bucket *oldest = NULL;
+
+    for (int i = 0; i < IP_PROBES; i++) {
+        struct ip_bucket *e = &ip_table[(h + i) & (IP_TABLE_SIZE - 1)];
+        if (e->used && e->addr == addr) {
+            return &e->bucket;
+        }
+        if (!e->used) {
+            oldest = e;
+            break;
+        }
+        if (oldest == NULL || timercmp(&e->bucket.last, &oldest->bucket.last, <)) {
+            oldest = e;
+        }
+    }
+    oldest->used = 1;
+    oldest->addr = addr;
+    init_bucket(&oldest->bucket, IP_BURST);
+    return &oldest->bucket;
+}
+
+/* Return 1 if a new connection from addr should be accepted. */
+int allow_connect(struct in_addr addr) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (take_token(find_ip_bucket(addr.s_addr), IP_RATE, IP_BURST, &now)) {
+        return 1;
+    }
+    rl_stats.connects_refused++;
+    return 0;
+}
+
+/* Decide whether a line just read from p may be handled. Lines over the
+ * limit for the connection or its address are dropped without a reply.
+ * After PENALTY_STRIKES drops we stop reading from p for PENALTY_MS, so
+ * its data waits in the kernel instead of costing us anything.
+ * Returns 1 if the line is allowed, 0 if it should be dropped.
+ */
+int allow_line(struct client *p, fd_set *allset) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (take_token(&p->bucket, LINE_RATE, LINE_BURST, &now)
+        && take_token(find_ip_bucket(p->ipaddr.s_addr), IP_RATE, IP_BURST, &now)) {
+        return 1;
+    }
+
+    rl_stats.lines_dropped++;
+    if (++p->strikes >= PENALTY_STRIKES) {
+        struct timeval penalty = {PENALTY_MS / 1000, (PENALTY_MS % 1000) * 1000};
+        timeradd(&now, &penalty, &p->paused_until);
+        p->paused = 1;
+        p->strikes = 0;
+        // Clients behind a gateway have no socket; their input is
+        // thrown away while they are paused instead
+        if (p->fd >= 0) {
+            FD_CLR(p->fd, allset);
+        }
+        rl_stats.pauses++;
+        printf("Pausing client %d %s for %d ms (%ld lines dropped, %ld pauses)\n",
+            p->fd, inet_ntoa(p->ipaddr), PENALTY_MS,
+            rl_stats.lines_dropped, rl_stats.pauses);
+    }
+    return 0;
+}
+
+/* Start reading again from clients in the list whose pause is over.
+ * Returns the number of milliseconds until the next one is due, or -1
+ * if no client in the list is paused.
+ */
+int release_paused(struct client *head, fd_set *allset) {
+    struct timeval now;
+    struct client *p;
+    long wait = -1;
+
+    gettimeofday(&now, NULL);
+    for (p = head; p != NULL; p = p->next) {
+        if (!p->paused) {
+            continue;
+        }
+        long left = elapsed_ms(&now, &p->paused_until);
+        if (left <= 0) {
+            p->paused = 0;
+            if (p->fd >= 0) {
+                FD_SET(p->fd, allset);
+            }
+        } else if (wait == -1 || left < wait) {
+            wait = left;
+        }
+    }
+    return wait;
+}
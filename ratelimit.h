@@ -0,0 +1,38 @@
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#define LINE_RATE 4          // Lines per second one connection may send
+#define LINE_BURST 8         // Lines a connection may send at once
+#define IP_RATE 16           // Lines and connects per second from one address
+#define IP_BURST 32
+#define PENALTY_STRIKES 8    // Dropped lines before a connection is paused
+#define PENALTY_MS 3000      // How long a paused connection is not read
+#define IP_TABLE_SIZE 1024   // Must be a power of two
+
+/* Tokens are added at a fixed rate up to a limit; each line costs one. */
+struct token_bucket {
+    double tokens;
+    struct timeval last;
+};
+
+/* Totals since the server started, printed when a connection is paused */
+struct rate_limit_stats {
+    long lines_dropped;
+    long connects_refused;
+    long pauses;
+};
+
+struct client;
+
+extern struct rate_limit_stats rl_stats;
+
+void init_bucket(struct token_bucket *b, double burst);
+int allow_connect(struct in_addr addr);
+int allow_line(struct client *p, fd_set *allset);
+int release_paused(struct client *head, fd_set *allset);
+
+#endif
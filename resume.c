@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "resume.h"
+
+/* Players by resume token, using open addressing with linear probing.
+ * Entries are moved back when one is deleted, so a lookup can stop at
+ * the first empty slot.
+ */
+static struct client *table[RESUME_TABLE_SIZE];
+static int num_tokens = 0;
+
+
+static unsigned int hash_token(char *token) {
+    unsigned int h = 2166136261u;
+    while (*token) {
+        h = (h ^ (unsigned char)*token++) * 16777619u;
+    }
+    return h & (RESUME_TABLE_SIZE - 1);
+}
+
+/* Fill buf with TOKEN_LEN hex digits from /dev/urandom. Tokens let a
+ * connection take over a seat, so random() is not good enough here.
+ */
+static int make_token(char *buf) {
+    unsigned char bytes[TOKEN_LEN / 2];
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1) {
+        perror("open /dev/urandom");
+        return -1;
+    }
+    int n = read(fd, bytes, sizeof(bytes));
+    close(fd);
+    if (n != sizeof(bytes)) {
+        fprintf(stderr, "Short read from /dev/urandom\n");
+        return -1;
+    }
+    for (int i = 0; i < sizeof(bytes); i++) {
+        sprintf(buf + 2 * i, "%02x", bytes[i]);
+    }
+    return 0;
+}
+
+static void insert_token(struct client *p) {
+    unsigned int i = hash_token(p->token);
+    while (table[i] != NULL) {
+        i = (i + 1) & (RESUME_TABLE_SIZE - 1);
+    }
+    table[i] = p;
+    num_tokens++;
+}
+
+/* Give p a new resume token and remember it. Returns 0 on success, or
+ * -1 if no token could be made, in which case p->token is left empty.
+ */
+int issue_token(struct client *p) {
+    p->token[0] = '\0';
+    // Keep the table sparse so probe sequences stay short
+    if (num_tokens >= RESUME_TABLE_SIZE * 3 / 4) {
+        fprintf(stderr, "Too many resume tokens, none issued to %s\n", p->name);
+        return -1;
+    }
+    do {
+        if (make_token(p->token) == -1) {
+            p->token[0] = '\0';
+            return -1;
+        }
+    } while (find_token(p->token) != NULL);
+
+    insert_token(p);
+    return 0;
+}
+
+/* Remember the token p already holds, for a player who moved here from
+ * another node. Returns -1, and clears the token, if it can't be kept.
+ */
+int restore_token(struct client *p) {
+    if (num_tokens >= RESUME_TABLE_SIZE * 3 / 4 || find_token(p->token) != NULL) {
+        p->token[0] = '\0';
+        return -1;
+    }
+    insert_token(p);
+    return 0;
+}
+
+/* Return the player holding token, or NULL if there is none. */
+struct client *find_token(char *token) {
+    unsigned int i = hash_token(token);
+    while (table[i] != NULL) {
+        if (strcmp(table[i]->token, token) == 0) {
+            return table[i];
+        }
+        i = (i + 1) & (RESUME_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+/* Remove p's token from the table. Must be called before p is freed. */
+void forget_token(struct client *p) {
+    if (p->token[0] == '\0') {
+        return;
+    }
+    unsigned int i = hash_token(p->token);
+    while (table[i] != p) {
+        if (table[i] == NULL) {
+            return;
+        }
+        i = (i + 1) & (RESUME_TABLE_SIZE - 1);
+    }
+    table[i] = NULL;
+    num_tokens--;
+    p->token[0] = '\0';
+
+    // Move later entries of the same run back into the hole if their
+    // home slot is at or before it.
+    unsigned int j = i;
+    while (1) {
+        j = (j + 1) & (RESUME_TABLE_SIZE - 1);
+        if (table[j] == NULL) {
+            break;
+        }
+        unsigned int k = hash_token(table[j]->token);
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            table[i] = table[j];
+            table[j] = NULL;
+            i = j;
+        }
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef _RESUME_H_
+#define _RESUME_H_
+
+#include "gameplay.h"
+
+#define RESUME_CMD "/resume"        // Entered with a token instead of a name
+#define RESUME_GRACE_MS 60000       // How long a dropped player keeps a seat
+#define RESUME_TABLE_SIZE 4096      // Must be a power of two
+
+int issue_token(struct client *p);
+int restore_token(struct client *p);
+struct client *find_token(char *token);
+void forget_token(struct client *p);
+
+#endif
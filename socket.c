@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <arpa/inet.h>     /* inet_ntoa */
 #include <netdb.h>         /* gethostname */
 #include <sys/socket.h>
@@ -71,24 +73,79 @@ int set_up_server_socket(struct sockaddr_in *self, int num_queue) {
 /*
  * Wait for and accept a new connection.
  * Terminate with exit code 1 if the accept call failed, otherwise return
- * the client's socket descriptor.
+ * the client's socket descriptor. The client's address is stored in peer.
  */
-int accept_connection(int listenfd) {
-    struct sockaddr_in peer;
-    unsigned int peer_len = sizeof(peer);
-    peer.sin_family = PF_INET;
+int accept_connection(int listenfd, struct sockaddr_in *peer) {
+    unsigned int peer_len = sizeof(*peer);
+    peer->sin_family = PF_INET;
 
     printf("Waiting for a new connection...\n");
-    int client_socket = accept(listenfd, (struct sockaddr *)&peer, &peer_len);
+    int client_socket = accept(listenfd, (struct sockaddr *)peer, &peer_len);
     if (client_socket < 0) {
         perror("accept");
         exit(1);
     } else {
         printf("New connection accepted from %s:%d\n",
-            inet_ntoa(peer.sin_addr),
-            ntohs(peer.sin_port));
+            inet_ntoa(peer->sin_addr),
+            ntohs(peer->sin_port));
         return client_socket;
     }
 }
 
 
+
+
+/*
+ * Fill in addr for host, a name or a dotted address, and port. Looking
+ * a name up can take a while, so this is done once at startup.
+ * Returns -1 if the host is unknown.
+ */
+int resolve_host(char *host, int port, struct sockaddr_in *addr) {
+    struct sockaddr_in *a = init_server_addr(port);
+    struct hostent *hp = gethostbyname(host);
+    if (hp == NULL) {
+        fprintf(stderr, "Unknown host %s\n", host);
+        free(a);
+        return -1;
+    }
+    a->sin_addr = *((struct in_addr *) hp->h_addr_list[0]);
+    *addr = *a;
+    free(a);
+    return 0;
+}
+
+/*
+ * Start connecting to addr without waiting for the server to answer.
+ * Returns the socket descriptor, which select reports as writable once
+ * the attempt is over, or -1 if it failed straight away.
+ */
+int start_connect(struct sockaddr_in *addr) {
+    int soc = socket(PF_INET, SOCK_STREAM, 0);
+    if (soc < 0) {
+        perror("socket");
+        exit(1);
+    }
+    fcntl(soc, F_SETFL, fcntl(soc, F_GETFL) | O_NONBLOCK);
+    if (connect(soc, (struct sockaddr *)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        close(soc);
+        return -1;
+    }
+    return soc;
+}
+
+/*
+ * Finish a connection begun by start_connect once its socket is
+ * writable, and make the socket blocking again.
+ * Returns 0 if the connection was made and -1 if not.
+ */
+int finish_connect(int soc) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(soc, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        fprintf(stderr, "connect: %s\n", strerror(err));
+        return -1;
+    }
+    fcntl(soc, F_SETFL, fcntl(soc, F_GETFL) & ~O_NONBLOCK);
+    return 0;
+}
@@ -5,6 +5,9 @@
 
 struct sockaddr_in *init_server_addr(int port);
 int set_up_server_socket(struct sockaddr_in *self, int num_queue);
-int accept_connection(int listenfd);
+int accept_connection(int listenfd, struct sockaddr_in *peer);
+int resolve_host(char *host, int port, struct sockaddr_in *addr);
+int start_connect(struct sockaddr_in *addr);
+int finish_connect(int soc);
 
 #endif
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "spectator.h"
+#include "protocol.h"
+
+/* Return the number of milliseconds from start to end. */
+static long elapsed_ms(struct timeval *start, struct timeval *end) {
+    return (end->tv_sec - start->tv_sec) * 1000
+        + (end->tv_usec - start->tv_usec) / 1000;
+}
+
+/* Render the board spectators see into game->snapshot, and into
+ * game->snapshot_frame for binary spectators. This is done at most once
+ * per game->version no matter how many spectators there are.
+ */
+static void render_snapshot(struct game_state *game) {
+    status_message(game->snapshot, game);
+    int len = strlen(game->snapshot);
+    int frame_len = board_frame(game->snapshot_frame, game);
+    if (game->has_next_turn != NULL) {
+        snprintf(game->snapshot + len, MAX_BUF - len, "It's %s's turn.\r\n",
+            game->has_next_turn->name);
+        frame_len += turn_frame(game->snapshot_frame + frame_len, game->has_next_turn, 0);
+    } else {
+        snprintf(game->snapshot + len, MAX_BUF - len, "Waiting for players.\r\n");
+    }
+    game->snapshot_len = strlen(game->snapshot);
+    game->snapshot_frame_len = frame_len;
+    game->snapshot_version = game->version;
+}
+
+/* Write as much of buf as the socket will take without blocking.
+ * If only part of it fits, the rest is kept in s->pending so the
+ * spectator never sees half a board. Returns 1 if all of buf was sent,
+ * 0 if the socket was full, and -1 if the spectator is gone.
+ */
+static int send_to_spectator(struct spectator *s, char *buf, int len) {
+    int sent = send(s->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        return -1;
+    }
+    // buf may be s->pending itself, so move rather than copy
+    memmove(s->pending, buf + sent, len - sent);
+    s->pending_len = len - sent;
+    return s->pending_len == 0;
+}
+
+/* Start sending the board of game to the client on fd. The caller must
+ * already have stopped selecting on fd. Spectators are never selected
+ * on, so fd is moved to a descriptor at or above FD_SETSIZE, leaving the
+ * low ones free for players. If there is no room for it there, the
+ * client is turned away instead.
+ */
+void add_spectator(struct game_state *game, int fd, struct in_addr addr, int proto) {
+    int high = fcntl(fd, F_DUPFD, FD_SETSIZE);
+    if (high == -1) {
+        perror("fcntl");
+        char *full = "There is no room for more spectators.\r\n";
+        send(fd, full, strlen(full), MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(fd);
+        return;
+    }
+    close(fd);
+    fd = high;
+
+    struct spectator *s = malloc(sizeof(struct spectator));
+    if (!s) {
+        perror("malloc");
+        exit(1);
+    }
+
+    printf("Adding spectator %s\n", inet_ntoa(addr));
+
+    s->fd = fd;
+    s->ipaddr = addr;
+    s->game = game;
+    s->proto = proto;
+    s->seen_version = game->version - 1;  // Send the board on the next update
+    s->pending_len = 0;
+    s->prev = NULL;
+    s->next = game->spectators;
+    if (game->spectators != NULL) {
+        game->spectators->prev = s;
+    }
+    game->spectators = s;
+    game->spectators_behind++;
+
+    char *msg = "You are now watching the game.\r\n";
+    if (proto == PROTO_BINARY) {
+        char frame[MAX_FRAME];
+        send(fd, frame, text_frame(frame, msg), MSG_DONTWAIT | MSG_NOSIGNAL);
+    } else {
+        send(fd, msg, strlen(msg), MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+}
+
+/* Unlink a spectator from its game and close its socket. */
+void remove_spectator(struct spectator *s) {
+    printf("Removing spectator %d %s\n", s->fd, inet_ntoa(s->ipaddr));
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        s->game->spectators = s->next;
+    }
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+    close(s->fd);
+    free(s);
+}
+
+/* Return 1 if the spectator has hung up. Whatever it sent is thrown
+ * away, since spectators can't do anything.
+ */
+static int hung_up(struct spectator *s) {
+    char buf[MAX_BUF];
+    int readcnt = recv(s->fd, buf, MAX_BUF, MSG_DONTWAIT);
+    return readcnt == 0 || (readcnt == -1 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+/* Remove the spectators of game that have hung up. */
+static void remove_hung_up(struct game_state *game) {
+    struct spectator *s, *next;
+    for (s = game->spectators; s != NULL; s = next) {
+        next = s->next;
+        if (hung_up(s)) {
+            remove_spectator(s);
+        }
+    }
+}
+
+/* Send the current board to every spectator that has not seen it, if at
+ * least SPECTATOR_INTERVAL_MS have passed since the last update. Boards
+ * that changed several times in between are sent once, and a spectator
+ * whose socket is still full from last time is skipped until it drains.
+ * Spectators are not selected on, so every SPECTATOR_CHECK_MS they are
+ * also checked for having hung up, whether or not there is a board to
+ * send; one that has gone is also noticed when a send to it fails.
+ * Returns how many milliseconds until this should be called again, or
+ * -1 if there are no spectators.
+ */
+int update_spectators(struct game_state *game) {
+    struct spectator *s, *next;
+    struct timeval now;
+    int behind = 0;
+
+    if (game->spectators == NULL) {
+        return -1;
+    }
+    gettimeofday(&now, NULL);
+    long check = SPECTATOR_CHECK_MS - elapsed_ms(&game->last_hangup_check, &now);
+    if (check <= 0) {
+        remove_hung_up(game);
+        game->last_hangup_check = now;
+        check = SPECTATOR_CHECK_MS;
+        if (game->spectators == NULL) {
+            return -1;
+        }
+    }
+    if (game->fanout_version == game->version && !game->spectators_behind) {
+        return check;
+    }
+    long wait = SPECTATOR_INTERVAL_MS - elapsed_ms(&game->last_fanout, &now);
+    if (wait > 0) {
+        return wait < check ? wait : check;
+    }
+
+    if (game->snapshot_version != game->version) {
+        render_snapshot(game);
+    }
+    for (s = game->spectators; s != NULL; s = next) {
+        next = s->next;
+        int result = 1;
+        if (s->pending_len > 0) {
+            result = send_to_spectator(s, s->pending, s->pending_len);
+        }
+        if (result == 1 && s->seen_version != game->version) {
+            if (s->proto == PROTO_BINARY) {
+                result = send_to_spectator(s, game->snapshot_frame, game->snapshot_frame_len);
+            } else {
+                result = send_to_spectator(s, game->snapshot, game->snapshot_len);
+            }
+            // Unless none of it went out, the rest follows from pending
+            if (result == 1 || s->pending_len > 0) {
+                s->seen_version = game->version;
+            }
+        }
+        if (result == -1) {
+            remove_spectator(s);
+        } else if (result == 0 || s->seen_version != game->version) {
+            behind++;
+        }
+    }
+
+    game->last_fanout = now;
+    game->fanout_version = game->version;
+    game->spectators_behind = behind;
+    return behind && SPECTATOR_INTERVAL_MS < check ? SPECTATOR_INTERVAL_MS : check;
+}
@@ -0,0 +1,33 @@
+#ifndef _SPECTATOR_H_
+#define _SPECTATOR_H_
+
+#include "gameplay.h"
+
+#define SPECTATE_CMD "/watch"      // Entered instead of a name to spectate
+#define SPECTATOR_INTERVAL_MS 250  // Minimum time between board updates
+#define SPECTATOR_CHECK_MS 1000    // How often spectators are checked for hang-ups
+
+/* A read-only client watching a game. Spectators never get a turn and
+ * are not part of broadcast(); instead they are sent the latest board at
+ * most once per SPECTATOR_INTERVAL_MS. A spectator that cannot keep up
+ * simply misses the boards in between. Spectators are kept out of select
+ * and do not count against FD_SETSIZE; instead update_spectators looks
+ * for ones that have hung up now and then.
+ */
+struct spectator {
+    int fd;
+    struct in_addr ipaddr;
+    struct game_state *game;
+    struct spectator *prev;
+    struct spectator *next;
+    int proto;                  // Whether to send snapshot or snapshot_frame
+    int seen_version;           // game->version of the last board sent
+    char pending[MAX_BUF];      // Unsent tail of the last board
+    int pending_len;
+};
+
+void add_spectator(struct game_state *game, int fd, struct in_addr addr, int proto);
+void remove_spectator(struct spectator *s);
+int update_spectators(struct game_state *game);
+
+#endif
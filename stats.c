@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+
+#define STATS_MAGIC "WSTATS1"
+#define TABLE_SIZE (2 * MAX_STATS)   // Must be a power of two
+
+/* Layout of the stats file. It is mapped into memory as a whole, so a
+ * record is updated simply by writing to it.
+ */
+struct stats_file {
+    char magic[8];
+    int count;
+    struct player_stats records[MAX_STATS];
+};
+
+/* A finished game result that has not been written to the file yet */
+struct stats_update {
+    char name[MAX_NAME];
+    int won;
+    int guesses_made;
+    int correct_guesses;
+};
+
+static struct stats_file *stats = NULL;
+
+/* order[] holds record indices from best to worst; rank[] is its inverse
+ * so we can find where a record sits in order[] without searching.
+ */
+static int order[MAX_STATS];
+static int rank[MAX_STATS];
+
+/* Open addressing hash table from player name to record index + 1.
+ * A 0 entry is empty. Records are never deleted, so no tombstones.
+ */
+static int table[TABLE_SIZE];
+
+static struct stats_update pending[MAX_PENDING];
+static int num_pending = 0;
+
+
+/* Return a negative number if a should be listed above b on the
+ * leaderboard, a positive number if below.
+ */
+static int compare_stats(struct player_stats *a, struct player_stats *b) {
+    if (a->wins != b->wins) {
+        return b->wins - a->wins;
+    }
+    // Fewer games for the same number of wins is better
+    if (a->games_played != b->games_played) {
+        return a->games_played - b->games_played;
+    }
+    return strcmp(a->name, b->name);
+}
+
+static int compare_index(const void *a, const void *b) {
+    return compare_stats(&stats->records[*(const int *)a],
+        &stats->records[*(const int *)b]);
+}
+
+static unsigned int hash_name(char *name) {
+    unsigned int h = 5381;
+    while (*name) {
+        h = h * 33 + (unsigned char)*name++;
+    }
+    return h;
+}
+
+/* Return the slot in table for name: either the slot holding it, or
+ * the empty slot where it should be inserted.
+ */
+static int find_slot(char *name) {
+    unsigned int i = hash_name(name) & (TABLE_SIZE - 1);
+    while (table[i] != 0 && strcmp(stats->records[table[i] - 1].name, name) != 0) {
+        i = (i + 1) & (TABLE_SIZE - 1);
+    }
+    return i;
+}
+
+/* Swap the record at position pos of order[] with its neighbours until
+ * it is in sorted position again. Only one record changes at a time, so
+ * this is cheap compared to sorting again.
+ */
+static void restore_order(int pos) {
+    while (pos > 0 && compare_index(&order[pos], &order[pos - 1]) < 0) {
+        int t = order[pos - 1];
+        order[pos - 1] = order[pos];
+        order[pos] = t;
+        rank[order[pos]] = pos;
+        rank[order[pos - 1]] = pos - 1;
+        pos--;
+    }
+    while (pos < stats->count - 1 && compare_index(&order[pos], &order[pos + 1]) > 0) {
+        int t = order[pos + 1];
+        order[pos + 1] = order[pos];
+        order[pos] = t;
+        rank[order[pos]] = pos;
+        rank[order[pos + 1]] = pos + 1;
+        pos++;
+    }
+}
+
+/* Map the stats file into memory, creating it if it does not exist,
+ * and build the name table and leaderboard order from its records.
+ */
+void stats_open(char *filename) {
+    int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("Opening stats file");
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    int is_new = (st.st_size == 0);
+    if (st.st_size < sizeof(struct stats_file)
+        && ftruncate(fd, sizeof(struct stats_file)) == -1) {
+        perror("ftruncate");
+        exit(1);
+    }
+
+    stats = mmap(NULL, sizeof(struct stats_file), PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    if (stats == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+
+    if (is_new) {
+        strcpy(stats->magic, STATS_MAGIC);
+        stats->count = 0;
+    } else if (strcmp(stats->magic, STATS_MAGIC) != 0
+        || stats->count < 0 || stats->count > MAX_STATS) {
+        fprintf(stderr, "%s is not a stats file\n", filename);
+        exit(1);
+    }
+
+    memset(table, 0, sizeof(table));
+    for (int i = 0; i < stats->count; i++) {
+        table[find_slot(stats->records[i].name)] = i + 1;
+        order[i] = i;
+    }
+    qsort(order, stats->count, sizeof(int), compare_index);
+    for (int i = 0; i < stats->count; i++) {
+        rank[order[i]] = i;
+    }
+    printf("Loaded stats for %d players\n", stats->count);
+}
+
+/* Write out anything still pending and unmap the file. */
+void stats_close(void) {
+    if (stats == NULL) {
+        return;
+    }
+    stats_flush();
+    msync(stats, sizeof(struct stats_file), MS_SYNC);
+    munmap(stats, sizeof(struct stats_file));
+    stats = NULL;
+}
+
+/* Remember the result of one finished game for a player. The result is
+ * only buffered here; stats_flush applies it to the file later so the
+ * end of a game does not have to wait on the stats store.
+ */
+void stats_record(char *name, int won, int guesses_made, int correct_guesses) {
+    if (num_pending == MAX_PENDING) {
+        stats_flush();
+    }
+    struct stats_update *u = &pending[num_pending++];
+    strncpy(u->name, name, MAX_NAME);
+    u->name[MAX_NAME - 1] = '\0';
+    u->won = won;
+    u->guesses_made = guesses_made;
+    u->correct_guesses = correct_guesses;
+}
+
+/* Apply all buffered results to the stats file and keep the leaderboard
+ * order up to date. Returns the number of results applied.
+ */
+int stats_flush(void) {
+    int applied = num_pending;
+    if (stats == NULL || num_pending == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < num_pending; i++) {
+        struct stats_update *u = &pending[i];
+        int slot = find_slot(u->name);
+        int index;
+        if (table[slot] != 0) {
+            index = table[slot] - 1;
+        } else if (stats->count < MAX_STATS) {
+            // First game for this player; it starts at the bottom
+            index = stats->count++;
+            memset(&stats->records[index], 0, sizeof(struct player_stats));
+            strcpy(stats->records[index].name, u->name);
+            table[slot] = index + 1;
+            order[index] = index;
+            rank[index] = index;
+        } else {
+            fprintf(stderr, "Stats file is full, dropping result for %s\n", u->name);
+            continue;
+        }
+
+        struct player_stats *s = &stats->records[index];
+        s->games_played++;
+        s->wins += u->won;
+        s->total_guesses += u->guesses_made;
+        s->correct_guesses += u->correct_guesses;
+        restore_order(rank[index]);
+    }
+    num_pending = 0;
+
+    // Let the kernel write the pages back when it suits it
+    msync(stats, sizeof(struct stats_file), MS_ASYNC);
+    return applied;
+}
+
+/* Point top[0..n-1] at the best n players. Returns how many were found,
+ * which is less than n if fewer players have finished a game.
+ */
+int stats_top(struct player_stats **top, int n) {
+    int i;
+    if (stats == NULL) {
+        return 0;
+    }
+    for (i = 0; i < n && i < stats->count; i++) {
+        top[i] = &stats->records[order[i]];
+    }
+    return i;
+}
+
+/* Return the average number of guesses per game for a player. */
+double stats_average_guesses(struct player_stats *s) {
+    if (s->games_played == 0) {
+        return 0.0;
+    }
+    return (double)s->total_guesses / s->games_played;
+}
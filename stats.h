@@ -0,0 +1,29 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "gameplay.h"
+
+#define STATS_FILE "wordsrv.stats"
+#define MAX_STATS 1024        // Number of player records the stats file holds
+#define MAX_PENDING 64        // Game results buffered before they are applied
+#define LEADERBOARD_SIZE 3
+
+/* One record per player name. The records live in a memory-mapped file
+ * so they survive server restarts.
+ */
+struct player_stats {
+    char name[MAX_NAME];
+    int games_played;
+    int wins;
+    int correct_guesses;      // Letters guessed that were in the word
+    int total_guesses;        // Used with games_played for the average
+};
+
+void stats_open(char *filename);
+void stats_close(void);
+void stats_record(char *name, int won, int guesses_made, int correct_guesses);
+int stats_flush(void);
+int stats_top(struct player_stats **top, int n);
+double stats_average_guesses(struct player_stats *s);
+
+#endif
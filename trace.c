@@ -0,0 +1,110 @@
+#ifdef TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+struct trace_event {
+    const char *name;
+    long long start;
+    long long duration;
+};
+
+/* One thread's records. Threads add their buffer to the list the first
+ * time they record anything, so the dump can find them all.
+ */
+struct trace_ring {
+    struct trace_event events[TRACE_RING];
+    unsigned int count;       // Records ever written; the last TRACE_RING are kept
+    long tid;
+    struct trace_ring *next;
+};
+
+static __thread struct trace_ring *ring = NULL;
+static struct trace_ring *rings = NULL;
+static volatile sig_atomic_t dump_requested = 0;
+
+
+long long trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Record the scope s, which has just ended. */
+void trace_end(struct trace_scope *s) {
+    long long end = trace_now();
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(struct trace_ring));
+        if (ring == NULL) {
+            return;
+        }
+        ring->tid = syscall(SYS_gettid);
+        do {
+            ring->next = rings;
+        } while (!__sync_bool_compare_and_swap(&rings, ring->next, ring));
+    }
+    struct trace_event *e = &ring->events[ring->count++ % TRACE_RING];
+    e->name = s->name;
+    e->start = s->start;
+    e->duration = end - s->start;
+}
+
+static void request_dump(int sig) {
+    dump_requested = 1;
+}
+
+/* Dump the trace buffers on SIGUSR1. select returns early for the
+ * signal anyway, so the dump is written straight away; SA_RESTART keeps
+ * it from failing a blocking read or write to a client.
+ */
+void trace_init() {
+    struct sigaction sa;
+    sa.sa_handler = request_dump;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
+    printf("Tracing; send SIGUSR1 to pid %d to write %s\n", getpid(), TRACE_FILE);
+}
+
+/* Write every buffer to TRACE_FILE if a dump has been asked for. Must be
+ * called between events, since other threads' records are read as they
+ * are. Complete ("X") events are used, with times in microseconds.
+ */
+void trace_dump_if_requested() {
+    struct trace_ring *r;
+    int written = 0;
+    if (!dump_requested) {
+        return;
+    }
+    dump_requested = 0;
+
+    FILE *fp = fopen(TRACE_FILE, "w");
+    if (fp == NULL) {
+        perror("fopen " TRACE_FILE);
+        return;
+    }
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (r = rings; r != NULL; r = r->next) {
+        unsigned int n = r->count < TRACE_RING ? r->count : TRACE_RING;
+        for (unsigned int i = r->count - n; i != r->count; i++) {
+            struct trace_event *e = &r->events[i % TRACE_RING];
+            fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":%ld}", written++ ? ",\n" : "",
+                e->name, e->start / 1000.0, e->duration / 1000.0, getpid(), r->tid);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    printf("Wrote %d trace events to %s\n", written, TRACE_FILE);
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/* Trace points, compiled in only when TRACE is defined ("make TRACE=1").
+ *
+ * TRACE_SCOPE(name) at the top of a block records how long the rest of
+ * the block took, however it is left. Records go into a ring buffer per
+ * thread holding the last TRACE_RING of them. Sending the server SIGUSR1
+ * writes what the buffers hold to TRACE_FILE as Chrome trace JSON, which
+ * can be opened in Perfetto (ui.perfetto.dev) or chrome://tracing.
+ * Without TRACE the macros expand to nothing.
+ */
+#define TRACE_RING 65536
+#define TRACE_FILE "wordsrv.trace.json"
+
+#ifdef TRACE
+
+struct trace_scope {
+    const char *name;
+    long long start;    // Nanoseconds on the monotonic clock
+};
+
+long long trace_now();
+void trace_end(struct trace_scope *s);
+void trace_init();
+void trace_dump_if_requested();
+
+#define TRACE_SCOPE(name) \
+    struct trace_scope _trace_scope __attribute__((cleanup(trace_end))) = {name, trace_now()}
+#define TRACE_INIT() trace_init()
+#define TRACE_DUMP_IF_REQUESTED() trace_dump_if_requested()
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_INIT()
+#define TRACE_DUMP_IF_REQUESTED()
+
+#endif
+
+#endif
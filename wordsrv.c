@@ -6,13 +6,23 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <time.h>
+#include <signal.h>
 
 #include "socket.h"
 #include "gameplay.h"
+#include "stats.h"
+#include "spectator.h"
+#include "ratelimit.h"
+#include "resume.h"
+#include "protocol.h"
+#include "cluster.h"
+#include "bot.h"
+#include "trace.h"
 
 
 #ifndef PORT
@@ -33,7 +43,12 @@ void advance_turn(struct game_state *game);
 /* Send the message in outbuf to all clients */
 void broadcast(struct game_state *game, char *outbuf);
 void broadcast_two_messages(struct game_state *game, char *first_msg, char *second_msg);
+void broadcast_typed(struct game_state *game, char *outbuf, char *frame, int frame_len);
+void broadcast_two_typed(struct game_state *game, char *first_msg, char *second_msg,
+    char *first_frame, int first_len, char *second_frame, int second_len);
+void broadcast_status(struct game_state *game, char *outbuf, int whole_board);
 int read_newline(struct client *p, char *newline);
+int read_input(struct client *p, char *newline);
 void disconnect_with_next_turn(struct game_state *game, struct client *p, char *first_msg);
 void disconnect_without_next_turn(struct game_state *game, struct client *p,
     char *first_msg, char *second_msg);
@@ -52,6 +67,42 @@ void write_welcome_message(struct client **new_players, struct client *p);
 void new_player_enter_game(struct client **new_players, struct game_state *game, struct client *p,
     char *first_msg, char *second_msg, char *newline);
 void announce_winner(struct game_state *game, struct client *winner);
+void record_game_results(struct game_state *game, struct client *winner);
+void broadcast_leaderboard(struct game_state *game, char *outbuf);
+void make_spectator(struct client **new_players, struct game_state *game, struct client *p);
+int unlink_player(struct client **top, struct client *p);
+void detach_player(struct game_state *game, struct client *p, char *first_msg);
+int expire_detached(struct game_state *game, char *first_msg);
+void resume_player(struct client **new_players, struct game_state *game, struct client *p,
+    char *first_msg, char *second_msg, char *token);
+int sooner(int a_ms, int b_ms);
+void request_shutdown(int sig);
+void handle_player_input(struct client *p, int result, char *newline, char *dict_name);
+void handle_new_player_input(struct client **new_players, struct client *p, int result,
+    char *newline);
+struct game_state *add_room(char *id, struct dictionary *dict, char *dict_name);
+struct game_state *find_room(char *id, char *dict_name);
+void reap_rooms(struct client *new_players);
+void make_link(struct client **new_players, struct client *p);
+struct link *find_link(int fd);
+void read_link(struct link *l, struct client **new_players, char *dict_name);
+void open_stream(struct link *l, struct client **new_players, unsigned int stream,
+    char *payload, int len, char *dict_name);
+void add_bot(struct game_state *game, struct client *p);
+int play_bots(struct game_state *game, char *dict_name);
+void close_stream(struct link *l, struct client **new_players, unsigned int stream,
+    char *dict_name);
+void feed_stream(struct link *l, struct client **new_players, unsigned int stream,
+    char *data, int len, char *dict_name);
+int next_line(struct client *p, char *newline);
+int next_input(struct client *p, char *newline);
+struct client *find_client(int fd, struct client *new_players);
+void handle_input(struct client **new_players, struct client *p, int result, char *newline,
+    char *dict_name);
+void read_client(struct client **new_players, struct client *p, char *dict_name);
+void export_room(struct link *l, struct client **new_players, char *payload, int len);
+void import_room(struct link *l, struct client **new_players, char *payload, int len,
+    char *dict_name);
 
 
 
@@ -62,6 +113,21 @@ void announce_winner(struct game_state *game, struct client *winner);
  */
 fd_set allset;
 
+/* Set by SIGINT or SIGTERM; the main loop stops at the end of the
+ * iteration so the stats file can be closed cleanly.
+ */
+volatile sig_atomic_t shutdown_requested = 0;
+
+/* Every room on this server, the default room "" first. */
+struct game_state *rooms = NULL;
+
+/* Connections from gateways, and the descriptor to give the next client
+ * that arrives through one. These are negative so they never clash with
+ * a socket, and unique so remove_player and move_player still work.
+ */
+struct link *links = NULL;
+int next_virtual_fd = -2;
+
 
 /* Add a client to the head of the linked list
  */
@@ -80,6 +146,18 @@ void add_player(struct client **top, int fd, struct in_addr addr) {
     p->name[0] = '\0';
     p->in_ptr = p->inbuf;
     p->inbuf[0] = '\0';
+    p->guesses_made = 0;
+    p->correct_guesses = 0;
+    init_bucket(&p->bucket, LINE_BURST);
+    p->strikes = 0;
+    p->paused = 0;
+    p->token[0] = '\0';
+    p->detached = 0;
+    p->proto = PROTO_UNKNOWN;
+    p->game = NULL;
+    p->link = NULL;
+    p->stream = 0;
+    p->bot = 0;
     p->next = *top;
     *top = p;
 }
@@ -97,8 +175,15 @@ void remove_player(struct client **top, int fd) {
     if (*p) {
         struct client *t = (*p)->next;
         printf("Removing client %d %s\n", fd, inet_ntoa((*p)->ipaddr));
-        FD_CLR((*p)->fd, &allset);
-        close((*p)->fd);
+        forget_token(*p);
+        if ((*p)->link != NULL) {
+            // Let the gateway close the real connection
+            link_send((*p)->link->fd, LINK_CLOSE, (*p)->stream, NULL, 0);
+            (*p)->link->streams[(*p)->stream] = NULL;
+        } else if ((*p)->fd >= 0) {
+            FD_CLR((*p)->fd, &allset);
+            close((*p)->fd);
+        }
         free(*p);
         *p = t;
     } else {
@@ -123,21 +208,55 @@ void move_player(struct client **new_player, struct client **active_player, int
     }
 }
 
-/* Move the has_next_turn pointer to the next active client */
+/* Move the has_next_turn pointer to the next active client. Players
+ * whose connection dropped keep their place but are skipped; if nobody
+ * else is connected, has_next_turn becomes NULL.
+ */
 void advance_turn(struct game_state *game) {
-    if (game->has_next_turn == NULL || game->has_next_turn->next == NULL) {
-        game->has_next_turn = game->head;
+    struct client *p;
+    int num_players = 0;
+    for (p = game->head; p != NULL; p = p->next) {
+        num_players++;
     }
-    else {
-        game->has_next_turn = game->has_next_turn->next;
+
+    for (int i = 0; i < num_players; i++) {
+        if (game->has_next_turn == NULL || game->has_next_turn->next == NULL) {
+            game->has_next_turn = game->head;
+        }
+        else {
+            game->has_next_turn = game->has_next_turn->next;
+        }
+        if (!game->has_next_turn->detached) {
+            break;
+        }
+    }
+    if (game->has_next_turn != NULL && game->has_next_turn->detached) {
+        game->has_next_turn = NULL;
     }
+    game->version++;
 }
 
 /* Send the message in outbuf to all clients */
 void broadcast(struct game_state *game, char *outbuf) {
+    broadcast_typed(game, outbuf, NULL, 0);
+}
+
+/* Send one message to the a certain client, and send another message to all
+ * clients expect the client receving the first message.
+ */
+void broadcast_two_messages(struct game_state *game, char *first_msg, char *second_msg) {
+    broadcast_two_typed(game, first_msg, second_msg, NULL, 0, NULL, 0);
+}
+
+/* Like broadcast, but binary clients get frame instead of outbuf. */
+void broadcast_typed(struct game_state *game, char *outbuf, char *frame, int frame_len) {
+    TRACE_SCOPE("broadcast");
     struct client *p;
     for(p = game->head; p != NULL; p = p->next) {
-        if(write(p->fd, outbuf, strlen(outbuf)) == -1) {
+        if (p->detached) {
+            continue;
+        }
+        if(write_typed(p, outbuf, frame, frame_len) == -1) {
             fprintf(stderr, "Write to client %s failed\n", inet_ntoa(p->ipaddr));
             if (game->has_next_turn == p) {
                 advance_turn(game);
@@ -147,20 +266,25 @@ void broadcast(struct game_state *game, char *outbuf) {
     }
 }
 
-/* Send one message to the a certain client, and send another message to all
- * clients expect the client receving the first message.
+/* Like broadcast_two_messages, but binary clients get first_frame and
+ * second_frame instead.
  */
-void broadcast_two_messages(struct game_state *game, char *first_msg, char *second_msg) {
+void broadcast_two_typed(struct game_state *game, char *first_msg, char *second_msg,
+    char *first_frame, int first_len, char *second_frame, int second_len) {
+    TRACE_SCOPE("broadcast");
     struct client *p;
     for(p = game->head; p != NULL; p = p->next) {
+        if (p->detached) {
+            continue;
+        }
         if (game->has_next_turn == p) {
-            if(write(p->fd, first_msg, strlen(first_msg)) == -1) {
+            if(write_typed(p, first_msg, first_frame, first_len) == -1) {
                 fprintf(stderr, "Write to client %s failed\n", inet_ntoa(p->ipaddr));
                 advance_turn(game);
                 remove_player(&(game->head), p->fd);
             }
         } else {
-            if(write(p->fd, second_msg, strlen(second_msg)) == -1) {
+            if(write_typed(p, second_msg, second_frame, second_len) == -1) {
                 fprintf(stderr, "Write to client %s failed\n", inet_ntoa(p->ipaddr));
                 remove_player(&(game->head), p->fd);
             }
@@ -170,74 +294,81 @@ void broadcast_two_messages(struct game_state *game, char *first_msg, char *seco
 
 
 
-/* Read from input and add the result to in_ptr. Once we've read the 
- * network newline then we successfully get one newline, and returns 0.
- * Otherwise, returns -1 if the client closes; and return -2 if the
- * newline is too long.
+/* Send the state of the game to all clients. Text clients always get the
+ * status message; binary clients get the whole board if whole_board is
+ * set and only what the last guess changed otherwise.
  */
-int read_newline(struct client *p, char *newline) {
-    int readcnt;
-    int postion, i;
-    int is_too_long = 0;
-    while (1) {
-        // if the read functions fails, indicating that the client closes.
-        readcnt = read(p->fd, p->in_ptr, MAX_BUF-strlen(p->inbuf)-1);
+void broadcast_status(struct game_state *game, char *outbuf, int whole_board) {
+    char frame[MAX_FRAME];
+    int frame_len;
+    if (whole_board) {
+        frame_len = board_frame(frame, game);
+    } else {
+        frame_len = delta_frame(frame, game);
+    }
+    status_message(outbuf, game);
+    broadcast_typed(game, outbuf, frame, frame_len);
+}
+
+/* Read one line or frame from p, depending on the protocol it speaks.
+ * The protocol is picked from the first byte the client sends: if it
+ * is PROTO_MAGIC we acknowledge it and switch to frames.
+ * Returns the same values as read_newline, 1 if no whole line or frame
+ * has arrived yet, or 2 if the first byte was LINK_MAGIC, meaning the
+ * client is a gateway and nothing was read.
+ */
+int read_input(struct client *p, char *newline) {
+    if (p->proto == PROTO_UNKNOWN) {
+        unsigned char first;
+        int readcnt = recv(p->fd, &first, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (readcnt == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        }
         if (readcnt <= 0) {
             printf("[%d] Read 0 bytes\n", p->fd);
             return -1;
         }
-        printf("[%d] Read %d bytes\n", p->fd, readcnt);
-        p->in_ptr = p->in_ptr+readcnt;
-        *p->in_ptr = '\0';
-
-        
-        // Now find the network newline \r\n.
-        postion = -1;
-        for (postion = 0 ; postion < strlen(p->inbuf)-1; postion++) {
-            if (p->inbuf[postion] == '\r' && p->inbuf[postion+1] == '\n') {
-                //find end postion
-                break;
-            }
+        if (first == LINK_MAGIC) {
+            return 2;
         }
-        // if the network newline does not exist or the position of \r is
-        // at the end of inbuf
-        if (postion == -1 || postion == strlen(p->inbuf)-1){
-            // not find, continue read
-            if (strlen(p->inbuf) == MAX_BUF -1) {
-                // inbuf full
-                is_too_long = 1;
-                // and clear inbuf
-                p->in_ptr = p->inbuf;
+        if (first == PROTO_MAGIC) {
+            recv(p->fd, &first, 1, 0);
+            if (write(p->fd, &first, 1) == -1) {
+                return -1;
             }
-            continue;
-        }
-
-        // assign the new line
-        for (i=0; i < postion; i ++) {
-            newline[i] = p->inbuf[i];
-        }
-        newline[i] = '\0';
-
-        // move remaining characters
-        postion += 2;
-        i = 0;
-        while (postion < strlen(p->inbuf)) {
-            p->inbuf[i] = p->inbuf[postion];
-            postion ++;
-            i ++;
+            printf("[%d] Using binary protocol\n", p->fd);
+            p->proto = PROTO_BINARY;
+            // Frames may follow in the same packet; if not, select says so
+            return read_frame(p, newline);
+        } else {
+            p->proto = PROTO_TEXT;
         }
-        p->inbuf[i] = '\0';
-        p->in_ptr = p->inbuf + strlen(p->inbuf);
-        
-        printf("[%d] Found newline %s\n", p->fd, newline);
-        break;
     }
+    if (p->proto == PROTO_BINARY) {
+        return read_frame(p, newline);
+    }
+    return read_newline(p, newline);
+}
 
-    // if the new line is too long, returns -2
-    if (is_too_long)
-        return -2;
-
-    return 0;
+/* Read whatever p has sent so far, without waiting for more, and take
+ * the first line out of inbuf as next_line does. Returns 0 if there was
+ * a line, 1 if no whole line has arrived yet, -1 if the client closed,
+ * and -2 if the line was too long, in which case it is thrown away.
+ */
+int read_newline(struct client *p, char *newline) {
+    TRACE_SCOPE("read_newline");
+    int used = p->in_ptr - p->inbuf;
+    // A full inbuf always holds a line or is emptied by next_line
+    int readcnt = recv(p->fd, p->in_ptr, MAX_BUF - 1 - used, MSG_DONTWAIT);
+    if (readcnt == 0 || (readcnt == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        printf("[%d] Read 0 bytes\n", p->fd);
+        return -1;
+    }
+    if (readcnt > 0) {
+        p->in_ptr += readcnt;
+        *p->in_ptr = '\0';
+    }
+    return next_line(p, newline);
 }
 
 /* Close the socket and remove player when someone with the next turn disconnects. */
@@ -261,16 +392,132 @@ void disconnect_without_next_turn(struct game_state *game, struct client *p,
     remove_player(&(game->head), p->fd);
     broadcast(game, first_msg);
     // ask turn player
-    sprintf(first_msg, "Your guess?\r\n");
-    sprintf(second_msg, "It's %s's turn.\r\n", (game->has_next_turn)->name);
-    broadcast_two_messages(game, first_msg, second_msg);
+    if (game->has_next_turn != NULL) {
+        announce_turn(game, first_msg, second_msg);
+    }
+}
+
+/* Keep the seat of a player whose connection dropped for RESUME_GRACE_MS,
+ * so they can come back with their resume token. The socket is closed
+ * and the turn moves on if it was theirs.
+ */
+void detach_player(struct game_state *game, struct client *p, char *first_msg) {
+    struct timeval grace = {RESUME_GRACE_MS / 1000, (RESUME_GRACE_MS % 1000) * 1000};
+    struct timeval now;
+
+    printf("Detaching %s, holding seat for %d ms\n", p->name, RESUME_GRACE_MS);
+    if (p->link != NULL) {
+        link_send(p->link->fd, LINK_CLOSE, p->stream, NULL, 0);
+        p->link->streams[p->stream] = NULL;
+        p->link = NULL;
+    } else if (p->fd >= 0) {
+        FD_CLR(p->fd, &allset);
+        close(p->fd);
+    }
+    p->fd = -1;
+    p->detached = 1;
+    p->paused = 0;
+    gettimeofday(&now, NULL);
+    timeradd(&now, &grace, &p->detached_until);
+    if (game->has_next_turn == p) {
+        advance_turn(game);
+    }
+
+    sprintf(first_msg, "%s lost connection. Their seat is kept for %d seconds.\r\n",
+        p->name, RESUME_GRACE_MS / 1000);
+    broadcast(game, first_msg);
+}
+
+/* Remove players whose grace period is over. Returns the number of
+ * milliseconds until the next one runs out, or -1 if nobody is detached.
+ */
+int expire_detached(struct game_state *game, char *first_msg) {
+    struct client *p, *next;
+    struct timeval now;
+    int wait = -1;
+
+    gettimeofday(&now, NULL);
+    for (p = game->head; p != NULL; p = next) {
+        next = p->next;
+        if (!p->detached) {
+            continue;
+        }
+        if (timercmp(&now, &p->detached_until, <)) {
+            struct timeval left;
+            timersub(&p->detached_until, &now, &left);
+            wait = sooner(wait, left.tv_sec * 1000 + left.tv_usec / 1000 + 1);
+            continue;
+        }
+        printf("Seat of %s expired\n", p->name);
+        unlink_player(&(game->head), p);
+        forget_token(p);
+        sprintf(first_msg, "Goodbye %s\r\n", p->name);
+        free(p);
+        broadcast(game, first_msg);
+    }
+    return wait;
+}
+
+/* Give the seat of the detached player holding token to the new
+ * connection p. p itself is freed; its socket now belongs to the seat.
+ */
+void resume_player(struct client **new_players, struct game_state *game, struct client *p,
+    char *first_msg, char *second_msg, char *token) {
+    struct client *seat = find_token(token);
+    // A gateway sends each room to one node, so a seat can only be
+    // taken back from the room it is in
+    if (seat == NULL || !seat->detached || seat->game != game) {
+        sprintf(first_msg, "That resume token is not valid.\r\n%s", WELCOME_MSG);
+        if(write_to_client(p, first_msg) == -1) {
+            fprintf(stderr, "Write to client %s failed\n", inet_ntoa(p->ipaddr));
+            remove_player(new_players, p->fd);
+        }
+        return;
+    }
+
+    unlink_player(new_players, p);
+    seat->fd = p->fd;
+    seat->ipaddr = p->ipaddr;
+    seat->bucket = p->bucket;
+    seat->strikes = p->strikes;
+    seat->in_ptr = seat->inbuf;
+    seat->inbuf[0] = '\0';
+    seat->detached = 0;
+    seat->proto = p->proto;
+    seat->link = p->link;
+    seat->stream = p->stream;
+    if (seat->link != NULL) {
+        seat->link->streams[seat->stream] = seat;
+    }
+    free(p);
+    if (game->has_next_turn == NULL) {
+        game->has_next_turn = seat;
+        game->version++;
+    }
+
+    sprintf(first_msg, "%s is back.\r\n", seat->name);
+    printf("%s is back.\n", seat->name);
+    broadcast(game, first_msg);
+    char frame[MAX_FRAME];
+    int frame_len = board_frame(frame, game);
+    status_message(first_msg, game);
+    if(write_typed(seat, first_msg, frame, frame_len) == -1) {
+        fprintf(stderr, "Write to client %s failed\n", inet_ntoa(seat->ipaddr));
+        if (game->has_next_turn == seat) {
+            advance_turn(game);
+        }
+        remove_player(&(game->head), seat->fd);
+    }
+    if (game->has_next_turn != NULL) {
+        announce_turn(game, first_msg, second_msg);
+    }
 }
 
 /* Show someone who is not the next turn that the next turn is not him/her. */
 void not_turn_to_guess(struct game_state *game, struct client *p, char *first_msg) {
     sprintf(first_msg, "It is not your turn to guess.\r\n");
     printf("Player %s tried to guess out of turn\n", p->name);
-    if(write(p->fd, first_msg, strlen(first_msg)) == -1) {
+    if(write_to_client(p, first_msg) == -1) {
         fprintf(stderr, "Write to client %s failed\n", inet_ntoa(p->ipaddr));
         remove_player(&(game->head), p->fd);
     }
@@ -282,12 +529,19 @@ void handle_invalid_input(struct game_state *game, struct client *p,
     // guess it
     sprintf(first_msg, "%s guesses: %c\r\n", p->name, letter);
     int i;
+    game->delta_letter = letter;
+    game->delta_positions = 0;
     for(i=0;i<strlen(game->guess); ++i) {
         if (letter == (game->word)[i]) {
         (game->guess[i]) = letter;
+        game->delta_positions |= 1u << i;
         }
     }
-    broadcast(game, first_msg);
+    game->version++;
+    // binary clients only need to know what changed on the board
+    char frame[MAX_FRAME];
+    int frame_len = delta_frame(frame, game);
+    broadcast_typed(game, first_msg, frame, frame_len);
 }
 
 /* If the letter to be guessed, then guess this letter. There are two cases to analyze: The letter is indeed
@@ -295,9 +549,15 @@ void handle_invalid_input(struct game_state *game, struct client *p,
  * guess has already been guessed.
  */
 void guess_letter(struct game_state *game, struct client *p, char letter, char *first_msg, char *second_msg) {
+    char frame[MAX_FRAME];
+    int frame_len;
+    p->guesses_made++;
+    game->delta_letter = letter;
+    game->delta_positions = 0;
     //if the letter has not been guessed yet and this letter is in the word
     if ((game->letters_guessed)[letter-'a'] == 0
         && strchr(game->word, letter) != NULL) {
+        p->correct_guesses++;
         //then guess it
         sprintf(first_msg, "%s guesses: %c\r\n", p->name, letter);
         int i;
@@ -305,9 +565,11 @@ void guess_letter(struct game_state *game, struct client *p, char letter, char *
         for(i=0;i<strlen(game->guess); ++i) {
             if (letter == (game->word)[i]) {
                 (game->guess)[i] = letter;
+                game->delta_positions |= 1u << i;
             }
         }
-        broadcast(game, first_msg);
+        frame_len = guess_frame(frame, p, letter, 1);
+        broadcast_typed(game, first_msg, frame, frame_len);
     } else {
         // Otherwise, the letter is not in the word
         // error
@@ -317,13 +579,15 @@ void guess_letter(struct game_state *game, struct client *p, char letter, char *
         // notify all
 
         sprintf(second_msg, "%s guesses: %c\r\n", p->name, letter);
-        broadcast_two_messages(game, first_msg, second_msg);
+        frame_len = guess_frame(frame, p, letter, 0);
+        broadcast_two_typed(game, first_msg, second_msg, frame, frame_len, frame, frame_len);
         // change turn
         advance_turn(game);
         game->guesses_left -= 1;
     }
     // mark this letter as guessed
     (game->letters_guessed)[letter-'a'] = 1;
+    game->version++;
 
 }
 
@@ -340,13 +604,14 @@ void operations_after_each_turn(struct game_state *game, struct client *p, char
             //sprintf(msg, "The word was %s.\r\nNo guesses left. Game over.\r\n", game.word);
             sprintf(first_msg, "No more guesses.  The word was %s\r\n", game->word);
             printf("Evaluating for game_over\n");
-            broadcast(game, first_msg);
+            char frame[MAX_FRAME];
+            int frame_len = game_over_frame(frame, game, GAME_LOST, NULL);
+            broadcast_typed(game, first_msg, frame, frame_len);
+            record_game_results(game, NULL);
         } else {
             // the case when successfully guess the word
-            sprintf(first_msg, "The word was %s.\r\nGame over! You win!\r\n", game->word);
-            sprintf(second_msg, "The word was %s.\r\nGame over! %s win!\r\n", game->word, p->name);
-            printf("Game over. %s won!\n",p->name);
-            broadcast_two_messages(game, first_msg, second_msg);
+            announce_winner(game, p);
+            record_game_results(game, p);
         }
 
         // init the game
@@ -354,15 +619,66 @@ void operations_after_each_turn(struct game_state *game, struct client *p, char
         init_game(game, dict_name);
         sprintf(first_msg, "\r\n\r\nLet's start a new game\r\n");
         // broadcast(game, first_msg);
-        status_message(first_msg, game);
-        broadcast(game, first_msg);
+        broadcast_status(game, first_msg, 1);
     } else {
         // print game state
-        status_message(first_msg, game);
-        broadcast(game, first_msg);
+        broadcast_status(game, first_msg, 0);
     }
 }
 
+/* Tell the winner they won and everybody else who won. The winner is the
+ * player with the current turn, since a correct guess keeps the turn.
+ */
+void announce_winner(struct game_state *game, struct client *winner) {
+    char first_msg[MAX_BUF];
+    char second_msg[MAX_BUF];
+    char first_frame[MAX_FRAME];
+    char second_frame[MAX_FRAME];
+    sprintf(first_msg, "The word was %s.\r\nGame over! You win!\r\n", game->word);
+    sprintf(second_msg, "The word was %s.\r\nGame over! %s win!\r\n", game->word, winner->name);
+    int first_len = game_over_frame(first_frame, game, GAME_YOU_WON, winner);
+    int second_len = game_over_frame(second_frame, game, GAME_OTHER_WON, winner);
+    printf("Game over. %s won!\n", winner->name);
+    broadcast_two_typed(game, first_msg, second_msg,
+        first_frame, first_len, second_frame, second_len);
+}
+
+/* Queue a stats update for every player in the game that just ended and
+ * reset their per-game counters. winner is NULL if nobody won.
+ */
+void record_game_results(struct game_state *game, struct client *winner) {
+    struct client *p;
+    game->results_pending = 1;
+    for (p = game->head; p != NULL; p = p->next) {
+        if (p->bot) {
+            continue;
+        }
+        stats_record(p->name, p == winner, p->guesses_made, p->correct_guesses);
+        p->guesses_made = 0;
+        p->correct_guesses = 0;
+    }
+}
+
+/* Send the top of the leaderboard to all players. */
+void broadcast_leaderboard(struct game_state *game, char *outbuf) {
+    struct player_stats *top[LEADERBOARD_SIZE];
+    int n = stats_top(top, LEADERBOARD_SIZE);
+    int len = sprintf(outbuf, "Leaderboard:\r\n");
+    for (int i = 0; i < n; i++) {
+        char line[MAX_BUF];
+        int line_len = snprintf(line, MAX_BUF, "%d. %s  wins: %d  games: %d  avg guesses: %.1f\r\n",
+            i + 1, top[i]->name, top[i]->wins, top[i]->games_played,
+            stats_average_guesses(top[i]));
+        // With long names not every line fits; drop the rest of the list
+        if (len + line_len >= MAX_BUF) {
+            break;
+        }
+        strcpy(outbuf + len, line);
+        len += line_len;
+    }
+    broadcast(game, outbuf);
+}
+
 /* Handle the case where the input letter is valid. We need to guess this letter first; then
  * do some operations after this turn of guess.
  */
@@ -377,7 +693,12 @@ void announce_turn(struct game_state *game, char *first_msg, char *second_msg) {
     sprintf(first_msg, "Your guess?\r\n");
     sprintf(second_msg, "It's %s's turn.\r\n", (game->has_next_turn)->name);
     printf("It's %s's turn.\n", (game->has_next_turn)->name);
-    broadcast_two_messages(game, first_msg, second_msg);
+    char first_frame[MAX_FRAME];
+    char second_frame[MAX_FRAME];
+    int first_len = turn_frame(first_frame, game->has_next_turn, 1);
+    int second_len = turn_frame(second_frame, game->has_next_turn, 0);
+    broadcast_two_typed(game, first_msg, second_msg,
+        first_frame, first_len, second_frame, second_len);
 }
 
 /* Check whether the name newly entered has already appeared among players. */
@@ -394,13 +715,48 @@ void find_name(struct game_state *game, int exist, char *name) {
 /* Write welcome message to new players. */
 void write_welcome_message(struct client **new_players, struct client *p) {
     char *greeting = WELCOME_MSG;
-    if(write(p->fd, greeting, strlen(greeting)) == -1) {
+    if(write_to_client(p, greeting) == -1) {
         fprintf(stderr, "Write to client %s failed\n", inet_ntoa(p->ipaddr));
         // remove client p from new players list
         remove_player(new_players, p->fd);
     }
 }
 
+/* Turn a client who asked to watch into a spectator. It is taken off the
+ * new players list without closing its socket.
+ */
+void make_spectator(struct client **new_players, struct game_state *game, struct client *p) {
+    if (p->link != NULL) {
+        // Spectators are sent to without blocking, which a link can't do
+        char *msg = "Spectating is only possible when connected directly.\r\n" WELCOME_MSG;
+        if (write_to_client(p, msg) == -1) {
+            remove_player(new_players, p->fd);
+        }
+        return;
+    }
+    if (unlink_player(new_players, p) == 0) {
+        FD_CLR(p->fd, &allset);
+        add_spectator(game, p->fd, p->ipaddr, p->proto);
+        free(p);
+    }
+}
+
+/* Take p out of the list without closing its socket or freeing it.
+ * Returns 0 on success, -1 if p is not in the list.
+ */
+int unlink_player(struct client **top, struct client *p) {
+    struct client **q;
+
+    for (q = top; *q && *q != p; q = &(*q)->next);
+
+    if (*q) {
+        *q = p->next;
+        return 0;
+    }
+    fprintf(stderr, "Trying to remove fd %d, but I don't know about it\n", p->fd);
+    return -1;
+}
+
 /* Handle the case where the input name is valid. We first make this new player to active player
  * list, then notify other players, then print the game state and announce turn.
  */
@@ -410,18 +766,30 @@ void new_player_enter_game(struct client **new_players, struct game_state *game,
     strcpy(p->name, newline);
     // new player to active player
     move_player(new_players, &(game->head), p->fd);
+    if (issue_token(p) == 0) {
+        sprintf(first_msg, "Your resume token is %s\r\n"
+            "If you lose connection, enter \"%s %s\" instead of your name.\r\n",
+            p->token, RESUME_CMD, p->token);
+        if(write_to_client(p, first_msg) == -1) {
+            fprintf(stderr, "Write to client %s failed\n", inet_ntoa(p->ipaddr));
+        }
+    }
     // init turn
     if ((game->has_next_turn) == NULL) {
         game->has_next_turn = p;
+        game->version++;
     }
 
     // notify all player, who enters the game
+    char frame[MAX_FRAME];
+    int frame_len = join_frame(frame, p);
     sprintf(first_msg, "%s has just joined.\r\n", newline);
     printf("%s has just joined.\n", newline);
-    broadcast(game, first_msg);
+    broadcast_typed(game, first_msg, frame, frame_len);
     // print  game state
+    frame_len = board_frame(frame, game);
     status_message(first_msg, game);
-    if(write(p->fd, first_msg, strlen(first_msg)) == -1) {
+    if(write_typed(p, first_msg, frame, frame_len) == -1) {
         fprintf(stderr, "Write to client %s failed\n", inet_ntoa(p->ipaddr));
         if ((game->has_next_turn) == p) {
             advance_turn(game);
@@ -432,33 +800,881 @@ void new_player_enter_game(struct client **new_players, struct game_state *game,
     announce_turn(game, first_msg, second_msg);
 }
 
+/* Handle a line from a player in a room: a guess if it is their turn,
+ * and a reminder that it isn't otherwise. result is what read_input
+ * returned, with -1 meaning the player has gone.
+ */
+void handle_player_input(struct client *p, int result, char *newline, char *dict_name) {
+    struct game_state *game = p->game;
+    char first_msg[MAX_BUF];
+    char second_msg[MAX_BUF];
+    char letter = newline[0];
+
+    if (result == 0 && strcmp(newline, BOT_CMD) == 0) {
+        // Adding a bot is a move, so only the player whose turn it is may
+        if (p == game->has_next_turn) {
+            add_bot(game, p);
+        } else {
+            not_turn_to_guess(game, p, first_msg);
+        }
+        return;
+    }
+    if (p == game->has_next_turn) {
+        // if cannot write to this player, meaning that the player disconnets
+        if (result == -1 && p->token[0] != '\0') {
+            detach_player(game, p, first_msg);
+        } else if (result == -1) {
+            disconnect_with_next_turn(game, p, first_msg);
+        } else {
+            // if the input is invalid
+            if (result == -2 || strlen(newline) != 1
+                || letter < 'a' || letter > 'z') {
+                handle_invalid_input(game, p, letter, first_msg);
+            } else {
+                // if the input letter is valid
+                handle_valid_input(game, p, letter, dict_name, first_msg, second_msg);
+            }
+        }
+        // do the announcing work for this turn
+        if (game->has_next_turn != NULL) {
+            announce_turn(game, first_msg, second_msg);
+        }
+
+    } else {
+        if (result == -1 && p->token[0] != '\0') {
+            detach_player(game, p, first_msg);
+        } else if (result == -1) {
+            disconnect_without_next_turn(game, p, first_msg, second_msg);
+        } else {
+            not_turn_to_guess(game, p, first_msg);
+        }
+    }
+}
+
+/* Handle a line from a client who has not entered an acceptable name. */
+void handle_new_player_input(struct client **new_players, struct client *p, int result,
+    char *newline) {
+    struct game_state *game = p->game;
+    char first_msg[MAX_BUF];
+    char second_msg[MAX_BUF];
+
+    if (result == -1) {
+        // close socket
+        printf("Disconnect from %s\n",inet_ntoa(p->ipaddr));
+        remove_player(new_players, p->fd);
+    }
+    else {
+        int exist = 0;
+        find_name(game, exist, newline);
+        // write welcome messsage to new players
+        if (result == -2 || exist == 1 || strlen(newline) == 0) {
+            write_welcome_message(new_players, p);
+        } else if (strcmp(newline, SPECTATE_CMD) == 0) {
+            make_spectator(new_players, game, p);
+        } else if (strncmp(newline, RESUME_CMD " ", strlen(RESUME_CMD " ")) == 0) {
+            resume_player(new_players, game, p, first_msg, second_msg,
+                newline + strlen(RESUME_CMD " "));
+        } else {
+            new_player_enter_game(new_players, game, p, first_msg, second_msg, newline);
+        }
+    }
+}
+
+/* Create a room with the given id and start a game in it. Rooms share
+ * the dictionary file, so dict is the one from an existing room, or has
+ * a NULL fp for the first room.
+ */
+struct game_state *add_room(char *id, struct dictionary *dict, char *dict_name) {
+    struct game_state *game = malloc(sizeof(struct game_state));
+    if (!game) {
+        perror("malloc");
+        exit(1);
+    }
+
+    printf("Adding room \"%s\"\n", id);
+    strncpy(game->room, id, MAX_ROOM);
+    game->room[MAX_ROOM - 1] = '\0';
+    game->dict = *dict;
+    game->version = 0;
+    game->spectators = NULL;
+    game->snapshot_version = -1;
+    game->fanout_version = 0;
+    game->spectators_behind = 0;
+    game->results_pending = 0;
+    timerclear(&game->last_fanout);
+    timerclear(&game->last_hangup_check);
+    timerclear(&game->bot_due);
+
+    init_game(game, dict_name);
+
+    // head and has_next_turn also don't change when a subsequent game is
+    // started so we initialize them here.
+    game->head = NULL;
+    game->has_next_turn = NULL;
+
+    // Keep the default room first; everything else goes after it
+    if (rooms == NULL) {
+        game->next_room = NULL;
+        rooms = game;
+    } else {
+        game->next_room = rooms->next_room;
+        rooms->next_room = game;
+    }
+    return game;
+}
+
+/* Return the room with the given id, creating it if there is none. */
+struct game_state *find_room(char *id, char *dict_name) {
+    struct game_state *game;
+    for (game = rooms; game != NULL; game = game->next_room) {
+        if (strcmp(game->room, id) == 0) {
+            return game;
+        }
+    }
+    return add_room(id, &rooms->dict, dict_name);
+}
+
+/* Free rooms other than the default one that nobody is in any more. */
+void reap_rooms(struct client *new_players) {
+    struct game_state **g = &rooms->next_room;
+    while (*g != NULL) {
+        struct game_state *game = *g;
+        struct client *p;
+        for (p = new_players; p != NULL && p->game != game; p = p->next);
+        if (game->head != NULL || game->spectators != NULL || p != NULL) {
+            g = &game->next_room;
+            continue;
+        }
+        printf("Removing room \"%s\"\n", game->room);
+        *g = game->next_room;
+        free(game);
+    }
+}
+
+/* Turn a new client whose first byte was LINK_MAGIC into a gateway link.
+ * The client itself is freed; the socket now belongs to the link, which
+ * is not trusted until read_link has checked its LINK_HELLO.
+ */
+void make_link(struct client **new_players, struct client *p) {
+    unsigned char magic;
+    if (link_secret() == NULL) {
+        fprintf(stderr, "Refusing gateway link from %s: %s is not set\n",
+            inet_ntoa(p->ipaddr), LINK_SECRET_ENV);
+        remove_player(new_players, p->fd);
+        return;
+    }
+    if (unlink_player(new_players, p) == -1) {
+        return;
+    }
+    struct link *l = malloc(sizeof(struct link));
+    if (!l) {
+        perror("malloc");
+        exit(1);
+    }
+
+    printf("Gateway link from %s on fd %d\n", inet_ntoa(p->ipaddr), p->fd);
+    l->fd = p->fd;
+    l->in_len = 0;
+    l->authed = 0;
+    memset(l->streams, 0, sizeof(l->streams));
+    l->next = links;
+    links = l;
+    free(p);
+
+    recv(l->fd, &magic, 1, 0);
+}
+
+/* Return the link using fd, or NULL if fd is not a link. */
+struct link *find_link(int fd) {
+    struct link *l;
+    for (l = links; l != NULL && l->fd != fd; l = l->next);
+    return l;
+}
+
+/* Read from a gateway link and handle every whole frame received. If the
+ * gateway has gone, all of its clients are treated as disconnected.
+ */
+void read_link(struct link *l, struct client **new_players, char *dict_name) {
+    int readcnt = read(l->fd, l->inbuf + l->in_len, LINK_BUF - l->in_len);
+    int type, len, size;
+    unsigned int stream;
+    char *payload;
+
+    if (readcnt > 0) {
+        l->in_len += readcnt;
+    }
+    while (readcnt > 0
+        && (size = link_next_frame(l->inbuf, l->in_len, &type, &stream, &payload, &len)) != 0) {
+        if (size == -1) {
+            fprintf(stderr, "Bad frame from gateway on fd %d\n", l->fd);
+            readcnt = -1;
+            break;
+        }
+        if (!l->authed) {
+            // Anything but the right secret first ends the link
+            if (type != LINK_HELLO || !link_secret_matches(payload, len)) {
+                fprintf(stderr, "Gateway on fd %d did not send the link secret\n", l->fd);
+                readcnt = -1;
+                break;
+            }
+            unsigned char magic = LINK_MAGIC;
+            l->authed = 1;
+            printf("Gateway on fd %d authenticated\n", l->fd);
+            if (write(l->fd, &magic, 1) == -1) {
+                fprintf(stderr, "Write to gateway failed\n");
+            }
+        } else if (type != LINK_PING && type != LINK_DRAIN && type != LINK_ROOM_STATE
+            && stream >= FD_SETSIZE) {
+            fprintf(stderr, "Gateway sent stream %u, which is out of range\n", stream);
+        } else if (type == LINK_OPEN) {
+            open_stream(l, new_players, stream, payload, len, dict_name);
+        } else if (type == LINK_DATA) {
+            feed_stream(l, new_players, stream, payload, len, dict_name);
+        } else if (type == LINK_CLOSE) {
+            close_stream(l, new_players, stream, dict_name);
+        } else if (type == LINK_PING) {
+            link_send(l->fd, LINK_PONG, 0, NULL, 0);
+        } else if (type == LINK_DRAIN) {
+            export_room(l, new_players, payload, len);
+        } else if (type == LINK_ROOM_STATE) {
+            import_room(l, new_players, payload, len, dict_name);
+        }
+        l->in_len -= size;
+        memmove(l->inbuf, l->inbuf + size, l->in_len);
+    }
+    if (readcnt > 0) {
+        return;
+    }
+
+    printf("Gateway link on fd %d closed\n", l->fd);
+    // Cut every client off the link before any of them is handled, so the
+    // goodbyes for one are not written to the link for the others. They
+    // count as detached until their turn, so broadcasts skip them.
+    struct client *gone[FD_SETSIZE];
+    int num_gone = 0;
+    for (stream = 0; stream < FD_SETSIZE; stream++) {
+        struct client *p = l->streams[stream];
+        if (p != NULL) {
+            l->streams[stream] = NULL;
+            p->link = NULL;
+            p->detached = 1;
+            gone[num_gone++] = p;
+        }
+    }
+    for (int i = 0; i < num_gone; i++) {
+        char newline[MAX_BUF] = "";
+        gone[i]->detached = 0;
+        if (gone[i]->name[0] == '\0') {
+            handle_new_player_input(new_players, gone[i], -1, newline);
+        } else {
+            handle_player_input(gone[i], -1, newline, dict_name);
+        }
+    }
+    struct link **q;
+    for (q = &links; *q != l; q = &(*q)->next);
+    *q = l->next;
+    FD_CLR(l->fd, &allset);
+    close(l->fd);
+    free(l);
+}
+
+/* A client connected to the gateway and asked for a room. It starts out
+ * as a new player in that room, just like a direct connection.
+ */
+void open_stream(struct link *l, struct client **new_players, unsigned int stream,
+    char *payload, int len, char *dict_name) {
+    char id[MAX_ROOM];
+    struct in_addr addr;
+
+    if (len < 4 || l->streams[stream] != NULL) {
+        fprintf(stderr, "Gateway sent a bad open for stream %u\n", stream);
+        return;
+    }
+    addr.s_addr = htonl(get_u32(payload));
+    len -= 4;
+    if (len >= MAX_ROOM) {
+        len = MAX_ROOM - 1;
+    }
+    memcpy(id, payload + 4, len);
+    id[len] = '\0';
+
+    if (!allow_connect(addr)) {
+        fprintf(stderr, "Too many connections from %s\n", inet_ntoa(addr));
+        link_send(l->fd, LINK_CLOSE, stream, NULL, 0);
+        return;
+    }
+    add_player(new_players, next_virtual_fd--, addr);
+    struct client *p = *new_players;
+    p->game = find_room(id, dict_name);
+    p->link = l;
+    p->stream = stream;
+    l->streams[stream] = p;
+    write_welcome_message(new_players, p);
+}
+
+/* The gateway closed a client's connection; handle it as if we had read
+ * end of file from it.
+ */
+void close_stream(struct link *l, struct client **new_players, unsigned int stream,
+    char *dict_name) {
+    struct client *p = l->streams[stream];
+    char newline[MAX_BUF] = "";
+    if (p == NULL) {
+        return;
+    }
+    // The stream is gone already, so there is nobody to send a close to
+    l->streams[stream] = NULL;
+    p->link = NULL;
+    if (p->name[0] == '\0') {
+        handle_new_player_input(new_players, p, -1, newline);
+    } else {
+        handle_player_input(p, -1, newline, dict_name);
+    }
+}
+
+/* Add bytes the gateway received from a client to the client's input,
+ * and handle each whole line or frame they complete, in the same way as
+ * read_input and main do for a direct connection.
+ */
+void feed_stream(struct link *l, struct client **new_players, unsigned int stream,
+    char *data, int len, char *dict_name) {
+    char newline[MAX_BUF];
+    struct client *p;
+
+    while (len > 0 && (p = l->streams[stream]) != NULL && !p->paused) {
+        if (p->proto == PROTO_UNKNOWN) {
+            if ((unsigned char)data[0] == PROTO_MAGIC) {
+                write_raw(p, data, 1);
+                printf("[%d] Using binary protocol\n", p->fd);
+                p->proto = PROTO_BINARY;
+                data++;
+                len--;
+                continue;
+            }
+            p->proto = PROTO_TEXT;
+        }
+
+        int used = p->in_ptr - p->inbuf;
+        int n = MAX_BUF - 1 - used;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(p->in_ptr, data, n);
+        p->in_ptr += n;
+        *p->in_ptr = '\0';
+        data += n;
+        len -= n;
+
+        int result;
+        while (l->streams[stream] == p && !p->paused
+            && (result = next_input(p, newline)) != 1) {
+            handle_input(new_players, p, result, newline, dict_name);
+        }
+    }
+}
+
+/* Take the next line or frame out of what p has already sent, without
+ * reading. Returns the same values as next_line and next_frame.
+ */
+int next_input(struct client *p, char *newline) {
+    if (p->proto == PROTO_BINARY) {
+        return next_frame(p, newline);
+    }
+    return next_line(p, newline);
+}
+
+/* Return the client on fd, whether it is choosing a name or playing in
+ * a room, or NULL if there is none.
+ */
+struct client *find_client(int fd, struct client *new_players) {
+    struct game_state *game;
+    struct client *p;
+    for (game = rooms; game != NULL; game = game->next_room) {
+        for (p = game->head; p != NULL && p->fd != fd; p = p->next);
+        if (p != NULL) {
+            return p;
+        }
+    }
+    for (p = new_players; p != NULL && p->fd != fd; p = p->next);
+    return p;
+}
+
+/* Handle one line or frame from p, where result is what read_input or
+ * next_input returned, unless p is sending faster than it may. The line
+ * is charged for before it is logged, so a flood is not echoed either.
+ */
+void handle_input(struct client **new_players, struct client *p, int result, char *newline,
+    char *dict_name) {
+    if (result != -1 && !allow_line(p, &allset)) {
+        // over the limit, drop it without a reply
+        return;
+    }
+    if (result == 0) {
+        printf("[%d] Found %s %s\n", p->fd, p->proto == PROTO_BINARY ? "frame" : "newline",
+            newline);
+    }
+    if (p->name[0] == '\0') {
+        handle_new_player_input(new_players, p, result, newline);
+    } else {
+        handle_player_input(p, result, newline, dict_name);
+    }
+}
+
+/* Read from a client connected directly and handle every whole line or
+ * frame that is now buffered. Nothing here waits for more input; what is
+ * left of a line or frame stays in inbuf until select says more came.
+ */
+void read_client(struct client **new_players, struct client *p, char *dict_name) {
+    char newline[MAX_BUF];
+    int fd = p->fd;
+    int result = read_input(p, newline);
+    if (result == 2) {
+        make_link(new_players, p);
+        return;
+    }
+    while (result != 1) {
+        handle_input(new_players, p, result, newline, dict_name);
+        // p may have left, or been freed, or paused for sending too fast
+        if (result == -1 || find_client(fd, *new_players) != p || p->paused) {
+            return;
+        }
+        result = next_input(p, newline);
+    }
+}
+
+/* Take the first line out of what is already in p->inbuf. Returns 0 if
+ * there was one, 1 if there is no whole line yet, and -2 if inbuf is
+ * full without one, in which case its contents are thrown away.
+ */
+int next_line(struct client *p, char *newline) {
+    char *end = strstr(p->inbuf, "\r\n");
+    if (end == NULL) {
+        if (p->in_ptr - p->inbuf == MAX_BUF - 1) {
+            newline[0] = '\0';
+            p->in_ptr = p->inbuf;
+            p->inbuf[0] = '\0';
+            return -2;
+        }
+        return 1;
+    }
+    int len = end - p->inbuf;
+    memcpy(newline, p->inbuf, len);
+    newline[len] = '\0';
+    // move remaining characters
+    memmove(p->inbuf, end + 2, p->in_ptr - (end + 2) + 1);
+    p->in_ptr -= len + 2;
+    return 0;
+}
+
+/* Append one seat of a room being moved to the LINK_ROOM_STATE at buf.
+ * Returns the number of bytes written, or 0 if it does not fit in room.
+ */
+static int put_seat(char *buf, int room, struct client *p, int flags) {
+    int name_len = strlen(p->name);
+    int len = 4 + 1 + 1 + 1 + name_len + TOKEN_LEN + 2 + 2;
+    if (len > room) {
+        return 0;
+    }
+    set_u32(buf, p->stream);
+    buf[4] = flags;
+    buf[5] = p->proto;
+    buf[6] = name_len;
+    memcpy(buf + 7, p->name, name_len);
+    memset(buf + 7 + name_len, 0, TOKEN_LEN);
+    memcpy(buf + 7 + name_len, p->token, strlen(p->token));
+    set_u16(buf + 7 + name_len + TOKEN_LEN, p->guesses_made);
+    set_u16(buf + 9 + name_len + TOKEN_LEN, p->correct_guesses);
+    return len;
+}
+
+/* Add p to the LINK_ROOM_STATE being built in state, which holds pos
+ * bytes and *seats seats so far. A seat that does not fit, in the frame
+ * or in the u8 seat count, is closed so the gateway does not send its
+ * client to a node that has never heard of it.
+ */
+static void export_seat(struct link *l, char *state, int *pos, int *seats,
+    struct client *p, int flags) {
+    int n = 0;
+    if (*seats < 255) {
+        n = put_seat(state + *pos, LINK_BUF - LINK_HEADER - *pos, p, flags);
+    }
+    if (n == 0) {
+        printf("No room to move %d, closing it\n", p->fd);
+        link_send(l->fd, LINK_CLOSE, p->stream, NULL, 0);
+        return;
+    }
+    *pos += n;
+    (*seats)++;
+}
+
+/* The gateway is draining this node: send it the state of a room along
+ * with every client in it that came through the link, and forget them.
+ * The gateway passes the state on to the room's next node.
+ */
+void export_room(struct link *l, struct client **new_players, char *payload, int len) {
+    char state[LINK_BUF - LINK_HEADER];
+    char id[MAX_ROOM];
+    struct game_state *game;
+    struct client *p, *next;
+    int pos = 0, seats = 0;
+
+    if (len >= MAX_ROOM) {
+        len = MAX_ROOM - 1;
+    }
+    memcpy(id, payload, len);
+    id[len] = '\0';
+    for (game = rooms; game != NULL && strcmp(game->room, id) != 0; game = game->next_room);
+
+    state[pos++] = len;
+    memcpy(state + pos, id, len);
+    pos += len;
+    state[pos++] = (game != NULL);
+    if (game != NULL) {
+        int word_len = strlen(game->word);
+        unsigned int mask = 0;
+        for (int i = 0; i < NUM_LETTERS; i++) {
+            if (game->letters_guessed[i]) {
+                mask |= 1u << i;
+            }
+        }
+        state[pos++] = word_len;
+        memcpy(state + pos, game->word, word_len);
+        memcpy(state + pos + word_len, game->guess, word_len);
+        pos += 2 * word_len;
+        set_u32(state + pos, mask);
+        state[pos + 4] = game->guesses_left;
+        pos += 5;
+    }
+    int count_pos = pos++;
+
+    // Seats go in turn order, then the clients still choosing a name
+    struct client *turn = game != NULL ? game->has_next_turn : NULL;
+    for (p = game != NULL ? game->head : NULL; p != NULL; p = p->next) {
+        if (p->link == l) {
+            export_seat(l, state, &pos, &seats, p, p == turn ? SEAT_HAS_TURN : 0);
+        }
+    }
+    for (p = *new_players; p != NULL; p = p->next) {
+        if (p->link == l && p->game == game) {
+            export_seat(l, state, &pos, &seats, p, SEAT_NEW);
+        }
+    }
+    state[count_pos] = seats;
+    printf("Moving room \"%s\" with %d clients to another node\n", id, seats);
+    link_send(l->fd, LINK_ROOM_STATE, 0, state, pos);
+    if (game == NULL) {
+        return;
+    }
+
+    // Every seat from the link was either sent or closed; none live here now
+    for (p = game->head; p != NULL; p = next) {
+        next = p->next;
+        if (p->link == l) {
+            if (game->has_next_turn == p) {
+                game->has_next_turn = NULL;
+            }
+            unlink_player(&(game->head), p);
+            forget_token(p);
+            l->streams[p->stream] = NULL;
+            free(p);
+        }
+    }
+    for (p = *new_players; p != NULL; p = next) {
+        next = p->next;
+        if (p->link == l && p->game == game) {
+            unlink_player(new_players, p);
+            l->streams[p->stream] = NULL;
+            free(p);
+        }
+    }
+    // Anyone left is connected directly
+    if (game->has_next_turn == NULL && game->head != NULL) {
+        char first_msg[MAX_BUF];
+        char second_msg[MAX_BUF];
+        advance_turn(game);
+        if (game->has_next_turn != NULL) {
+            announce_turn(game, first_msg, second_msg);
+        }
+    }
+}
+
+/* Take over a room another node gave up. Its game carries on where it
+ * was, unless the room is already busy here, and its clients keep their
+ * names, seats and place in the turn order.
+ */
+void import_room(struct link *l, struct client **new_players, char *payload, int len,
+    char *dict_name) {
+    char id[MAX_ROOM];
+    char *end = payload + len;
+    int id_len = (unsigned char)*payload++;
+
+    if (id_len >= MAX_ROOM || payload + id_len + 2 > end) {
+        fprintf(stderr, "Gateway sent a bad room state\n");
+        return;
+    }
+    memcpy(id, payload, id_len);
+    id[id_len] = '\0';
+    payload += id_len;
+
+    struct game_state *game = find_room(id, dict_name);
+    int fresh = (game->head == NULL);
+    if (*payload++) {
+        int word_len = (unsigned char)*payload++;
+        // The word block, then the seat count
+        if (word_len >= MAX_WORD || payload + 2 * word_len + 6 > end) {
+            fprintf(stderr, "Gateway sent a bad room state\n");
+            return;
+        }
+        if (fresh) {
+            memcpy(game->word, payload, word_len);
+            game->word[word_len] = '\0';
+            memcpy(game->guess, payload + word_len, word_len);
+            game->guess[word_len] = '\0';
+            unsigned int mask = get_u32(payload + 2 * word_len);
+            for (int i = 0; i < NUM_LETTERS; i++) {
+                game->letters_guessed[i] = (mask >> i) & 1;
+            }
+            game->guesses_left = (unsigned char)payload[2 * word_len + 4];
+            game->version++;
+        }
+        payload += 2 * word_len + 5;
+    }
+
+    int seats = (unsigned char)*payload++;
+    struct client **tail = &(game->head);
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+    for (int i = 0; i < seats; i++) {
+        if (payload + 7 > end) {
+            break;
+        }
+        unsigned int stream = get_u32(payload);
+        int flags = (unsigned char)payload[4];
+        int proto = (unsigned char)payload[5];
+        int name_len = (unsigned char)payload[6];
+        if (payload + 11 + name_len + TOKEN_LEN > end || name_len >= MAX_NAME
+            || stream >= FD_SETSIZE || l->streams[stream] != NULL) {
+            fprintf(stderr, "Gateway sent a bad seat\n");
+            break;
+        }
+
+        struct client *p;
+        struct in_addr addr = {0};
+        if (flags & SEAT_NEW) {
+            add_player(new_players, next_virtual_fd--, addr);
+            p = *new_players;
+        } else {
+            // Append, so the turn order stays the same
+            add_player(tail, next_virtual_fd--, addr);
+            p = *tail;
+            tail = &p->next;
+        }
+        memcpy(p->name, payload + 7, name_len);
+        p->name[name_len] = '\0';
+        memcpy(p->token, payload + 7 + name_len, TOKEN_LEN);
+        p->token[TOKEN_LEN] = '\0';
+        if (p->token[0] != '\0') {
+            restore_token(p);
+        }
+        p->guesses_made = get_u16(payload + 7 + name_len + TOKEN_LEN);
+        p->correct_guesses = get_u16(payload + 9 + name_len + TOKEN_LEN);
+        p->proto = proto;
+        p->game = game;
+        p->link = l;
+        p->stream = stream;
+        l->streams[stream] = p;
+        if ((flags & SEAT_HAS_TURN) && (fresh || game->has_next_turn == NULL)) {
+            game->has_next_turn = p;
+            game->version++;
+        }
+        payload += 11 + name_len + TOKEN_LEN;
+
+        // Show the board, which is not the one they were playing if the
+        // room was busy here; whose turn it is follows once all are in
+        if (!(flags & SEAT_NEW)) {
+            char msg[MAX_BUF];
+            char frame[MAX_FRAME];
+            int frame_len = board_frame(frame, game);
+            status_message(msg, game);
+            write_typed(p, msg, frame, frame_len);
+        }
+    }
+    if (game->has_next_turn == NULL && game->head != NULL) {
+        advance_turn(game);
+    }
+    printf("Took over room \"%s\" with %d clients\n", id, seats);
+    if (game->has_next_turn != NULL) {
+        char first_msg[MAX_BUF];
+        char second_msg[MAX_BUF];
+        announce_turn(game, first_msg, second_msg);
+    }
+}
+
+/* Add a bot to the room p is playing in, at p's request. */
+void add_bot(struct game_state *game, struct client *p) {
+    char msg[MAX_BUF];
+    char name[MAX_NAME];
+    struct client *q;
+    int bots = 0;
+
+    for (q = game->head; q != NULL; q = q->next) {
+        bots += q->bot;
+    }
+    if (bots >= MAX_BOTS || bot_load(&game->dict) <= 0) {
+        sprintf(msg, "No more bots can join this game.\r\n");
+        if (write_to_client(p, msg) == -1) {
+            fprintf(stderr, "Write to client %s failed\n", inet_ntoa(p->ipaddr));
+        }
+        return;
+    }
+    // Number bots so their names differ from everyone else's
+    for (int n = 1; ; n++) {
+        sprintf(name, "bot%d", n);
+        for (q = game->head; q != NULL && strcmp(q->name, name) != 0; q = q->next);
+        if (q == NULL) {
+            break;
+        }
+    }
+
+    struct in_addr none = {0};
+    add_player(&(game->head), next_virtual_fd--, none);
+    struct client *bot = game->head;
+    bot->bot = 1;
+    bot->proto = PROTO_TEXT;
+    bot->game = game;
+    strcpy(bot->name, name);
+    if (game->has_next_turn == NULL) {
+        game->has_next_turn = bot;
+    }
+    game->version++;
+
+    char frame[MAX_FRAME];
+    int frame_len = join_frame(frame, bot);
+    sprintf(msg, "%s has just joined.\r\n", name);
+    printf("%s added %s\n", p->name, name);
+    broadcast_typed(game, msg, frame, frame_len);
+}
+
+/* Let a bot take its turn once it has had BOT_DELAY_MS to think. Bots
+ * only play while a person is connected, and leave once everyone has.
+ * Returns the number of milliseconds until a bot is due to guess, or -1
+ * if no bot has the turn.
+ */
+int play_bots(struct game_state *game, char *dict_name) {
+    char first_msg[MAX_BUF];
+    char second_msg[MAX_BUF];
+    struct client *p, *next;
+    struct timeval now;
+    int bots = 0, people = 0, connected = 0;
+
+    for (p = game->head; p != NULL; p = p->next) {
+        if (p->bot) {
+            bots++;
+        } else {
+            people++;
+            connected += !p->detached;
+        }
+    }
+    if (bots > 0 && people == 0) {
+        for (p = game->head; p != NULL; p = next) {
+            next = p->next;
+            remove_player(&(game->head), p->fd);
+        }
+        game->has_next_turn = NULL;
+    }
+
+    struct client *turn = game->has_next_turn;
+    if (turn == NULL || !turn->bot || connected == 0) {
+        timerclear(&game->bot_due);
+        return -1;
+    }
+    gettimeofday(&now, NULL);
+    if (!timerisset(&game->bot_due)) {
+        struct timeval delay = {BOT_DELAY_MS / 1000, (BOT_DELAY_MS % 1000) * 1000};
+        timeradd(&now, &delay, &game->bot_due);
+        return BOT_DELAY_MS;
+    }
+    if (timercmp(&now, &game->bot_due, <)) {
+        struct timeval left;
+        timersub(&game->bot_due, &now, &left);
+        return left.tv_sec * 1000 + left.tv_usec / 1000 + 1;
+    }
+
+    timerclear(&game->bot_due);
+    char letter = bot_choose_letter(game);
+    handle_valid_input(game, turn, letter, dict_name, first_msg, second_msg);
+    if (game->has_next_turn != NULL) {
+        announce_turn(game, first_msg, second_msg);
+    }
+    // Come back straight away in case the next turn is a bot's too
+    return 0;
+}
+
+/* Return whichever of two waits in milliseconds ends first, where -1
+ * means no wait at all.
+ */
+int sooner(int a_ms, int b_ms) {
+    if (a_ms < 0 || (b_ms >= 0 && b_ms < a_ms)) {
+        return b_ms;
+    }
+    return a_ms;
+}
+
+void request_shutdown(int sig) {
+    shutdown_requested = 1;
+}
+
 
 int main(int argc, char **argv) {
     int clientfd, maxfd, nready;
     struct client *p;
     struct sockaddr_in q;
     fd_set rset;
+    int port = PORT;
     
-    if(argc != 2){
-        fprintf(stderr,"Usage: %s <dictionary filename>\n", argv[0]);
+    if(argc != 2 && argc != 3){
+        fprintf(stderr,"Usage: %s <dictionary filename> [port]\n", argv[0]);
         exit(1);
     }
-    
-    // Create and initialize the game state
-    struct game_state game;
+    // Several nodes of a cluster can run on one machine on their own ports
+    if (argc == 3) {
+        port = strtol(argv[2], NULL, 10);
+    }
+    char *dict_name = argv[1];
 
     srandom((unsigned int)time(NULL));
+    TRACE_INIT();
+    // Spectators are moved above FD_SETSIZE, so allow as many descriptors
+    // as we are permitted to
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &nofile) == -1) {
+            perror("setrlimit");
+        }
+    }
     // Set up the file pointer outside of init_game because we want to 
     // just rewind the file when we need to pick a new word
-    game.dict.fp = NULL;
-    game.dict.size = get_file_length(argv[1]);
+    struct dictionary dict;
+    dict.fp = NULL;
+    dict.size = get_file_length(dict_name);
+    stats_open(STATS_FILE);
 
-    init_game(&game, argv[1]);
-    
-    // head and has_next_turn also don't change when a subsequent game is
-    // started so we initialize them here.
-    game.head = NULL;
-    game.has_next_turn = NULL;
+    // Stop on SIGINT or SIGTERM so the stats file is synced before exiting
+    struct sigaction sa;
+    sa.sa_handler = request_shutdown;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGINT, &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
+    // A client or gateway that goes away mid write must not take us with it
+    signal(SIGPIPE, SIG_IGN);
+
+    // Clients that connect directly play in the default room
+    add_room("", &dict, dict_name);
     
     /* A list of client who have not yet entered their name.  This list is
      * kept separate from the list of active players in the game, because
@@ -468,7 +1684,7 @@ int main(int argc, char **argv) {
      */
     struct client *new_players = NULL;
     
-    struct sockaddr_in *server = init_server_addr(PORT);
+    struct sockaddr_in *server = init_server_addr(port);
     int listenfd = set_up_server_socket(server, MAX_QUEUE);
     
     // initialize allset and add listenfd to the
@@ -478,18 +1694,59 @@ int main(int argc, char **argv) {
     // maxfd identifies how far into the set to search
     maxfd = listenfd;
 
-    while (1) {
+    while (!shutdown_requested) {
+        TRACE_SCOPE("event loop");
+        TRACE_DUMP_IF_REQUESTED();
+        // Spectators get their updates between events, so if any are
+        // waiting for one we must not block in select for too long.
+        struct timeval timeout;
+        struct timeval *wait = NULL;
+        // Paused clients are likewise released between events.
+        // So are players whose seat is no longer kept for them.
+        char expire_msg[MAX_BUF];
+        struct game_state *game;
+        int wait_ms = release_paused(new_players, &allset);
+        for (game = rooms; game != NULL; game = game->next_room) {
+            wait_ms = sooner(wait_ms, update_spectators(game));
+            wait_ms = sooner(wait_ms, release_paused(game->head, &allset));
+            wait_ms = sooner(wait_ms, expire_detached(game, expire_msg));
+            wait_ms = sooner(wait_ms, play_bots(game, dict_name));
+        }
+        if (wait_ms >= 0) {
+            timeout.tv_sec = wait_ms / 1000;
+            timeout.tv_usec = (wait_ms % 1000) * 1000;
+            wait = &timeout;
+        }
+
         // make a copy of the set before we pass it into select
         rset = allset;
-        nready = select(maxfd + 1, &rset, NULL, NULL, NULL);
+        {
+            TRACE_SCOPE("select");
+            nready = select(maxfd + 1, &rset, NULL, NULL, wait);
+        }
         if (nready == -1) {
-            perror("select");
+            // A signal, such as a request for a trace dump, is not an error
+            if (errno != EINTR) {
+                perror("select");
+            }
             continue;
         }
 
         if (FD_ISSET(listenfd, &rset)){
             printf("A new client is connecting\n");
-            clientfd = accept_connection(listenfd);
+            clientfd = accept_connection(listenfd, &q);
+            if (clientfd >= FD_SETSIZE) {
+                // select can't watch this descriptor
+                fprintf(stderr, "Too many connections, refusing fd %d\n", clientfd);
+                close(clientfd);
+                continue;
+            }
+            if (!allow_connect(q.sin_addr)) {
+                // Don't spend a greeting on an address that is flooding us
+                fprintf(stderr, "Too many connections from %s\n", inet_ntoa(q.sin_addr));
+                close(clientfd);
+                continue;
+            }
 
             FD_SET(clientfd, &allset);
             if (clientfd > maxfd) {
@@ -497,92 +1754,52 @@ int main(int argc, char **argv) {
             }
             printf("Connection from %s\n", inet_ntoa(q.sin_addr));
             add_player(&new_players, clientfd, q.sin_addr);
+            new_players->game = rooms;
             char *greeting = WELCOME_MSG;
             if(write(clientfd, greeting, strlen(greeting)) == -1) {
                 fprintf(stderr, "Write to client %s failed\n", inet_ntoa(q.sin_addr));
-                remove_player(&(game.head), p->fd);
+                remove_player(&new_players, clientfd);
             };
         }
         
         /* Check which other socket descriptors have something ready to read.
          * The reason we iterate over the rset descriptors at the top level and
-         * search through the two lists of clients each time is that it is
+         * search through the lists of clients each time is that it is
          * possible that a client will be removed in the middle of one of the
-         * operations. This is also why we call break after handling the input.
-         * If a client has been removed the loop variables may not longer be 
-         * valid.
+         * operations, so no pointer into the lists is kept between them.
          */
         int cur_fd;
         for(cur_fd = 0; cur_fd <= maxfd; cur_fd++) {
             if(FD_ISSET(cur_fd, &rset)) {
-                // Check if this socket descriptor is an active player
-                char newline[MAX_BUF];
-                char first_msg[MAX_BUF];
-                char second_msg[MAX_BUF];
-                // struct client *temp;
-                
-                for(p = game.head; p != NULL; p = p->next) {
-                    if(cur_fd == p->fd) {
-                        //TODO - handle input from an active client
-                        int result = read_newline(p, newline);
-                        char letter = newline[0];
-                        if (p == game.has_next_turn) {
-                            // if cannot write to this player, meaning that the player disconnets
-                            if (result == -1) {
-                                disconnect_with_next_turn(&game, p, first_msg);    
-                            } else {
-                                // if the input is invalid
-                                if (result == -2 || strlen(newline) != 1
-                                    || letter < 'a' || letter > 'z') {
-                                    handle_invalid_input(&game, p, letter, first_msg);
-                                } else {
-                                    // if the input letter is valid
-                                    char *dict_name = argv[1];
-                                    handle_valid_input(&game, p, letter, dict_name, first_msg, second_msg);
-                                }
-                            }
-                            // do the announcing work for this turn
-                            if (game.has_next_turn != NULL) {
-                                announce_turn(&game, first_msg, second_msg);
-                            }
-                            
-                        } else {
-                            if (result == -1) {
-                                disconnect_without_next_turn(&game, p, first_msg, second_msg);
-                            } else {
-                                not_turn_to_guess(&game, p, first_msg);
-                            }
-                        }
-                        break;
-                    }
+                struct link *l = find_link(cur_fd);
+                if (l != NULL) {
+                    read_link(l, &new_players, dict_name);
+                    continue;
                 }
-        
-                // Check if any new players are entering their names
-                for(p = new_players; p != NULL; p = p->next) {
-                    if(cur_fd == p->fd) {
-                        // TODO - handle input from an new client who has
-                        // not entered an acceptable name.
-                        int result = read_newline(p, newline);
-                        if (result == -1) {
-                            // close socket
-                            printf("Disconnect from %s\n",inet_ntoa(p->ipaddr));
-                            remove_player(&new_players, p->fd);
-                        }
-                        else {
-                            int exist = 0;
-                            find_name(&game, exist, newline);
-                            // write welcome messsage to new players
-                            if (result == -2 || exist == 1 || strlen(newline) == 0) {
-                                write_welcome_message(&new_players, p);
-                            } else {
-                                new_player_enter_game(&new_players, &game, p, first_msg, second_msg, newline);
-                            }
-                        }
-                        break;
-                    } 
+
+                p = find_client(cur_fd, new_players);
+                if (p != NULL) {
+                    read_client(&new_players, p, dict_name);
+                }
+            }
+        }
+
+        /* Results of games that ended during this iteration are applied
+         * here, after every player has had their messages written.
+         */
+        int flushed = stats_flush();
+        for (game = rooms; game != NULL; game = game->next_room) {
+            if (game->results_pending) {
+                char outbuf[MAX_BUF];
+                if (flushed > 0) {
+                    broadcast_leaderboard(game, outbuf);
                 }
+                game->results_pending = 0;
             }
         }
+        reap_rooms(new_players);
     }
+    printf("Shutting down\n");
+    stats_close();
     return 0;
 }